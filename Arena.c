@@ -0,0 +1,310 @@
+#include "Arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "Storage.h"
+#include "Pool.h"
+
+/// Bits of the node masks of `mbind`
+#define MaxNodes 64
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+
+/// Chunks are aligned to huge pages and take 8 pages at least
+#define HugePageSize ((size_t)2 << 20)
+#define ArenaObject poolObjectSize(sizeof(page) + PageSize)
+#define ArenaChunk ((ArenaObject * 8 + HugePageSize - 1) & ~(HugePageSize - 1))
+
+#define ChunkObjects (ArenaChunk / ArenaObject)
+
+/// A chunk of the range, mapped while it has pages in use or is the last one of its pool with room
+typedef struct chunk {
+    void* free; /// freed pages of the chunk, linked through their first word
+    uint32_t carved; /// pages handed out from the start once at least, the rest was never touched
+    uint32_t live; /// pages in use
+    uint8_t pool;
+    bool explicitHuge; /// mapped from the `MAP_HUGETLB` pool
+    bool listed; /// on the list of its pool
+    struct chunk* prev; /// of chunks of a pool with room, or of unmapped ones with `next` only
+    struct chunk* next;
+} chunk;
+
+/// Chunks of one node with room for a page, freed pages are reused before new chunks are mapped
+typedef struct nodePool {
+    pthread_mutex_t lock;
+    chunk* room;
+} nodePool;
+
+/// Set once by `configureArena`, before any page is allocated
+static struct {
+    int policy;
+    int node; /// of `ArenaNode`
+    int huge;
+    atomic_bool explicitFailed; /// the pool of huge pages ran out once, it is not asked again
+    _Atomic size_t explicitBytes;
+    int nodes; /// NUMA nodes of the machine, `1` without NUMA
+    char* base; /// of the reserved range, chunks are mapped over it as needed
+    size_t length;
+    _Atomic size_t used; /// bytes of the range given to chunks
+    _Atomic size_t mapped; /// of them, those mapped now
+    chunk* chunks; /// one for every `ArenaChunk` of the range
+    pthread_mutex_t unmappedLock;
+    chunk* unmapped; /// given back to the system, mapped again before the range grows
+    nodePool pools[MaxNodes];
+} arena;
+
+/// Counts the nodes from `/sys`, the highest online one tells
+static int countNodes(void) {
+    FILE* f = fopen("/sys/devices/system/node/online", "r");
+    if (!f) return 1;
+    int nodes = 1, low, high;
+    while (fscanf(f, "%d", &low) == 1) {
+        high = low;
+        if (fscanf(f, "-%d", &high) != 1) high = low;
+        if (high + 1 > nodes) nodes = high + 1;
+        if (fgetc(f) != ',') break;
+    }
+    fclose(f);
+    return nodes < MaxNodes ? nodes : MaxNodes;
+}
+
+/// Binds the calling thread, and every thread it starts later, to the CPUs of `node`. Only `ArenaNode` does,
+/// the other policies leave the FUSE workers to the scheduler
+/// - Returns: `false` if the node has no CPUs listed
+static bool bindThreads(int node) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int low, high;
+    while (fscanf(f, "%d", &low) == 1) {
+        high = low;
+        if (fscanf(f, "-%d", &high) != 1) high = low;
+        for (int cpu = low; cpu <= high && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &cpus);
+        if (fgetc(f) != ',') break;
+    }
+    fclose(f);
+    return CPU_COUNT(&cpus) && sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+/// Sets up the `policy` and chunks of `huge` pages for pages of up to `maxBytes` of files, any size if `0`,
+/// and binds the threads to the `node` of `ArenaNode`. Called once, before the first page is allocated and
+/// threads are started
+/// - Returns: `false` if the policy cannot be applied, pages come from `malloc` then
+bool configureArena(int policy, int node, int huge, size_t maxBytes) {
+    if (policy == ArenaOff && huge == HugeOff) return true;
+    arena.nodes = countNodes();
+    if (policy == ArenaNode && (node < 0 || node >= arena.nodes || !bindThreads(node))) {
+        errno = EINVAL;
+        return false;
+    }
+
+    // room for every page the quota allows, chunks of every node partly used, and aligning the start
+    size_t memory = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = (maxBytes && maxBytes < memory ? maxBytes : memory) / PageSize + 1;
+    size_t chunks = pages / (ArenaChunk / ArenaObject) + 1 + (size_t)arena.nodes;
+    size_t length = chunks * ArenaChunk;
+    char* range = mmap(NULL, length + HugePageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range == MAP_FAILED) return false;
+    arena.chunks = calloc(chunks, sizeof(chunk));
+    if (!arena.chunks) {
+        munmap(range, length + HugePageSize);
+        return false;
+    }
+
+    arena.base = (char*)(((uintptr_t)range + HugePageSize - 1) & ~(uintptr_t)(HugePageSize - 1));
+    arena.length = length;
+    for (int i = 0; i < MaxNodes; ++i)
+        pthread_mutex_init(&arena.pools[i].lock, NULL);
+    pthread_mutex_init(&arena.unmappedLock, NULL);
+    arena.policy = policy;
+    arena.node = node;
+    arena.huge = huge;
+    return true;
+}
+
+/// The pool pages allocated by the calling thread come from, the local one unless the policy says otherwise
+static int currentPool(void) {
+    if (arena.policy == ArenaInterleave) return 0;
+    if (arena.policy == ArenaNode) return arena.node;
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+    return (int)(node % (unsigned)arena.nodes);
+}
+
+/// Maps `c` over the reserved range with the biggest pages there are
+/// - Returns: `false` if out of memory
+static bool mapChunk(chunk* c, char* at) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+    // the pool is reserved here, so that running out of it fails now rather than at first touch
+    if (arena.huge == HugeExplicit && !atomic_load_explicit(&arena.explicitFailed, memory_order_relaxed)) {
+        if (mmap(at, ArenaChunk, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0) != MAP_FAILED) {
+            atomic_fetch_add(&arena.explicitBytes, ArenaChunk);
+            c->explicitHuge = true;
+            return true;
+        }
+        if (!atomic_exchange(&arena.explicitFailed, true))
+            fprintf(stderr, "Warning: out of explicit huge pages, using transparent ones: %s\n", strerror(errno));
+    }
+    if (mmap(at, ArenaChunk, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) return false;
+    if (arena.huge != HugeOff) madvise(at, ArenaChunk, MADV_HUGEPAGE); // small pages still work
+    c->explicitHuge = false;
+    return true;
+}
+
+/// Gives the memory of `c` back, huge pages to their pool too, and keeps its part of the range reserved
+/// for `newChunk` to map again
+static void unmapChunk(chunk* c) {
+    char* at = arena.base + (size_t)(c - arena.chunks) * ArenaChunk;
+    // still reserved if this fails, only resident until mapped over again
+    mmap(at, ArenaChunk, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    atomic_fetch_sub(&arena.mapped, ArenaChunk);
+    if (c->explicitHuge) atomic_fetch_sub(&arena.explicitBytes, ArenaChunk);
+
+    pthread_mutex_lock(&arena.unmappedLock);
+    c->next = arena.unmapped;
+    arena.unmapped = c;
+    pthread_mutex_unlock(&arena.unmappedLock);
+}
+
+static void listChunk(nodePool* p, chunk* c) {
+    c->prev = NULL;
+    c->next = p->room;
+    if (p->room) p->room->prev = c;
+    p->room = c;
+    c->listed = true;
+}
+
+static void unlistChunk(nodePool* p, chunk* c) {
+    if (c->prev) c->prev->next = c->next;
+    else p->room = c->next;
+    if (c->next) c->next->prev = c->prev;
+    c->listed = false;
+}
+
+/// Maps a chunk given back before, or the next one of the range, and places its memory before anything touches it
+/// - Returns: `NULL` once the range is used up or out of memory
+static chunk* newChunk(int pool) {
+    pthread_mutex_lock(&arena.unmappedLock);
+    chunk* c = arena.unmapped;
+    if (c) arena.unmapped = c->next;
+    pthread_mutex_unlock(&arena.unmappedLock);
+    if (!c) {
+        size_t at = atomic_fetch_add(&arena.used, ArenaChunk);
+        if (at + ArenaChunk > arena.length) return NULL;
+        c = &arena.chunks[at / ArenaChunk];
+    }
+    char* at = arena.base + (size_t)(c - arena.chunks) * ArenaChunk;
+    if (!mapChunk(c, at)) {
+        pthread_mutex_lock(&arena.unmappedLock);
+        c->next = arena.unmapped;
+        arena.unmapped = c;
+        pthread_mutex_unlock(&arena.unmappedLock);
+        return NULL;
+    }
+    atomic_fetch_add(&arena.mapped, ArenaChunk);
+
+    if (arena.policy != ArenaOff && arena.nodes > 1) {
+        unsigned long mask = arena.policy == ArenaInterleave
+            ? (arena.nodes < MaxNodes ? (1ul << arena.nodes) - 1 : ~0ul)
+            : 1ul << pool;
+        int mode = arena.policy == ArenaInterleave ? MPOL_INTERLEAVE : arena.policy == ArenaNode ? MPOL_BIND : MPOL_PREFERRED;
+        syscall(SYS_mbind, at, ArenaChunk, mode, &mask, MaxNodes + 1, 0); // a page elsewhere still works
+    }
+    *c = (chunk){ .pool = (uint8_t)pool, .explicitHuge = c->explicitHuge };
+    return c;
+}
+
+/// Hands out room for a full page with its header, not zeroed
+/// - Returns: `NULL` if the arena is off or full, the caller falls back to `malloc`
+void* arenaAlloc(void) {
+    if (!arena.base) return NULL;
+    int index = currentPool();
+    nodePool* p = &arena.pools[index];
+
+    pthread_mutex_lock(&p->lock);
+    chunk* c = p->room;
+    if (!c) {
+        c = newChunk(index);
+        if (!c) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        listChunk(p, c);
+    }
+    void* object = c->free;
+    if (object) c->free = *(void**)object;
+    else object = arena.base + (size_t)(c - arena.chunks) * ArenaChunk + c->carved++ * ArenaObject;
+    ++c->live;
+    if (!c->free && c->carved == ChunkObjects) unlistChunk(p, c);
+    pthread_mutex_unlock(&p->lock);
+    return object;
+}
+
+/// Takes back an object of `arenaAlloc` into the chunk it came from. A chunk left with no pages in use is
+/// given back to the system, unless it is the only one its pool has room in
+/// - Returns: `false` if `object` is not from the arena, nothing is done then
+bool arenaFree(void* object) {
+    char* at = object;
+    if (!arena.base || at < arena.base || at >= arena.base + arena.length) return false;
+    chunk* c = &arena.chunks[(size_t)(at - arena.base) / ArenaChunk];
+    nodePool* p = &arena.pools[c->pool];
+    pthread_mutex_lock(&p->lock);
+    *(void**)object = c->free;
+    c->free = object;
+    if (!c->listed) listChunk(p, c);
+    bool empty = !--c->live && (c->prev || c->next);
+    if (empty) unlistChunk(p, c);
+    pthread_mutex_unlock(&p->lock);
+
+    if (empty) unmapChunk(c);
+    return true;
+}
+
+/// Sums the transparent huge pages of the mappings in the range, read from `/proc` so only when asked
+static size_t transparentBytes(void) {
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) return 0;
+    char line[256];
+    size_t bytes = 0, kilobytes;
+    bool inside = false;
+    uintptr_t start, end;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            inside = start >= (uintptr_t)arena.base && end <= (uintptr_t)(arena.base + arena.length);
+        else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kilobytes) == 1)
+            bytes += kilobytes << 10;
+    }
+    fclose(f);
+    return bytes;
+}
+
+arenaUsage arenaStats(void) {
+    if (!arena.base) return (arenaUsage){ 0 };
+    return (arenaUsage){
+        .bytes = atomic_load(&arena.mapped),
+        .explicitHuge = atomic_load(&arena.explicitBytes),
+        .transparentHuge = arena.huge != HugeOff ? transparentBytes() : 0
+    };
+}
@@ -0,0 +1,39 @@
+#ifndef arena_h
+#define arena_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Full pages of file contents carved out of chunks of one address range reserved up front, with a pool of
+/// chunks for every NUMA node, so that a page lives where the policy says. Chunks are huge pages if asked to,
+/// so that scans of large files miss the TLB less. Partial pages of small files, and every page while the arena
+/// is off or full, come from `malloc`
+
+/// Where the pages go
+enum {
+    ArenaOff, /// `malloc` decides
+    ArenaLocal, /// the node of the writing thread
+    ArenaInterleave, /// spread page by page over all the nodes, for files read from everywhere
+    ArenaNode /// one node, which the threads are bound to as well
+};
+
+/// What backs the chunks, each one falls back to the next
+enum {
+    HugeOff, /// pages of the system size
+    HugeTransparent, /// `madvise` for transparent huge pages, if the kernel has some to spare
+    HugeExplicit /// `MAP_HUGETLB` from the reserved pool of 2 MiB pages, transparent ones once it is empty
+};
+
+/// Bytes of the chunks mapped now, chunks with no pages in use are given back
+typedef struct arenaUsage {
+    size_t bytes;
+    size_t explicitHuge; /// in the `MAP_HUGETLB` pool
+    size_t transparentHuge; /// made huge by the kernel, as `/proc/self/smaps` tells
+} arenaUsage;
+
+bool configureArena(int policy, int node, int huge, size_t maxBytes);
+void* arenaAlloc(void);
+bool arenaFree(void* object);
+arenaUsage arenaStats(void);
+
+#endif /* arena_h */
@@ -0,0 +1,290 @@
+#include "Directory.h"
+#include "Epoch.h"
+#include "Pool.h"
+#include "Stats.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+
+#define InitialCapacity 8
+#define Tombstone ((entry*)1)
+
+/// Name capacities of the entry pools, `8 << i` bytes including the terminator
+#define NEntryClasses 6
+#define entryClass(n) ((n) < 8 ? 0 : 29 - __builtin_clz((uint32_t)(n)))
+
+static pool entryPools[NEntryClasses] = {
+    PoolInit(sizeof(entry) + 8), PoolInit(sizeof(entry) + 16), PoolInit(sizeof(entry) + 32),
+    PoolInit(sizeof(entry) + 64), PoolInit(sizeof(entry) + 128), PoolInit(sizeof(entry) + 256)
+};
+static pool directories = PoolInit(sizeof(directory));
+
+static slotTable* newTable(uint32_t capacity);
+static bool rehash(directory* dir, uint32_t capacity);
+static _Atomic(entry*)* findSlot(slotTable* table, const char* name, size_t n, uint32_t hash);
+static void freeEntry(void* p);
+
+/// FNV-1a over the first `n` bytes of `name`
+uint32_t hashName(const char* name, size_t n) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/// Memory an entry with an `n` character name takes, with its share of an index kept under 3/4 full
+size_t entryFootprint(size_t n) {
+    if (n > NAME_MAX) return 0; // `addEntry` rejects it anyway
+    return entryPools[entryClass(n)].size + 2 * sizeof(_Atomic(entry*));
+}
+
+/// Memory an empty directory takes
+size_t directoryFootprint(void) {
+    return directories.size + sizeof(slotTable) + InitialCapacity * sizeof(_Atomic(entry*));
+}
+
+/// Allocates an empty directory, `.` and `..` are up to the caller
+/// - Returns: `NULL` if out of memory
+directory* newDirectory(void) {
+    directory* dir = poolAlloc(&directories);
+    if (!dir) return NULL;
+
+    slotTable* table = newTable(InitialCapacity);
+    if (!table) {
+        poolFree(&directories, dir);
+        return NULL;
+    }
+    atomic_init(&dir->index, table);
+    countStat(StatSlots, InitialCapacity);
+
+    return dir;
+}
+
+/// Frees all the entries and the index, does not touch inodes they point to
+void releaseDirectory(directory* dir) {
+    entry* p = dir->first;
+    while (p) {
+        entry* old = p;
+        p = p->next;
+        freeEntry(old);
+    }
+    countStat(StatEntries, -(int64_t)dir->count);
+    countStat(StatSlots, -(int64_t)dir->index->capacity);
+    free(dir->index);
+    poolFree(&directories, dir);
+}
+
+static void releaseDirectoryObject(void* dir) {
+    releaseDirectory(dir);
+}
+
+/// Same as `releaseDirectory`, but waits for the readers that might still be inside
+void retireDirectory(directory* dir) {
+    retire(dir, releaseDirectoryObject);
+}
+
+/// Looks up the entry with first `n` characters of `name`, safe to call concurrently with a writer
+/// - Returns: `NULL` if there is no such entry
+entry* findEntry(directory* dir, const char* name, size_t n) {
+    return findHashed(dir, name, n, hashName(name, n));
+}
+
+/// Same as `findEntry` with the `hashName` of the name already known
+entry* findHashed(directory* dir, const char* name, size_t n, uint32_t hash) {
+    entry* p = *findSlot(dir->index, name, n, hash);
+    if (p == NULL || p == Tombstone) {
+        errno = ENOENT;
+        return NULL;
+    }
+    return p;
+}
+
+/// Allocates an entry for `node` with first `n` characters of `name`, for `placeEntry` to publish
+/// - Returns the pointer to it, or `NULL` if error occurs
+entry* newEntry(const char* name, size_t n, struct inode* node) {
+    if (n > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    entry* result = poolAlloc(&entryPools[entryClass(n)]);
+    if (!result) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    memcpy(result->name, name, n);
+    result->hash = hashName(name, n);
+    result->length = (uint32_t)n;
+    result->node = node;
+    return result;
+}
+
+/// Frees an entry of `newEntry` that was never published
+void dropEntry(entry* p) {
+    freeEntry(p);
+}
+
+/// Allocates new entry for `node` at the end of `dir` with first `n` characters of `name`, and publishes it
+/// - Returns the pointer to it, or `NULL` if error occurs
+entry* addEntry(directory* dir, const char* name, size_t n, struct inode* node) {
+    if (n > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    // keep load factor (tombstones included) under 3/4
+    slotTable* table = dir->index;
+    if ((dir->used + 1) * 4 > table->capacity * 3) {
+        uint32_t capacity = table->capacity;
+        if ((dir->count + 1) * 2 > capacity) capacity *= 2;
+        if (!rehash(dir, capacity)) {
+            errno = ENOSPC;
+            return NULL;
+        }
+        table = dir->index;
+    }
+
+    entry* result = newEntry(name, n, node);
+    if (!result) return NULL;
+    result->cookie = ++dir->cookies;
+
+    // link into the list before the index, so that anything found can be iterated from
+    result->prev = dir->last;
+    if (dir->last) dir->last->next = result;
+    else dir->first = result;
+    dir->last = result;
+
+    _Atomic(entry*)* slot = findSlot(table, name, n, result->hash);
+    assert(*slot == NULL || *slot == Tombstone); // caller checks for existence
+    if (*slot == NULL) dir->used++;
+    *slot = result;
+    dir->count++;
+    countStat(StatEntries, 1);
+
+    return result;
+}
+
+/// Deletes `name`d entry in the `dir`, the entry itself is freed after concurrent readers are done with it
+/// - Returns: if entry was found, pointer to the corresponding inode, `NULL` otherwise
+struct inode* removeEntry(directory* dir, const char* name) {
+    size_t n = strlen(name);
+    slotTable* table = dir->index;
+    _Atomic(entry*)* slot = findSlot(table, name, n, hashName(name, n));
+    entry* old = *slot;
+    if (old == NULL || old == Tombstone) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    // the slot is followed by others in the probe sequence unless the next one is free
+    uint32_t i = (uint32_t)(slot - table->slots);
+    if (table->slots[(i + 1) & (table->capacity - 1)] == NULL) {
+        *slot = NULL;
+        dir->used--;
+    } else {
+        *slot = Tombstone;
+    }
+    dir->count--;
+    countStat(StatEntries, -1);
+
+    // `old->next` stays intact for readers standing on it
+    if (old->prev) old->prev->next = (entry*)old->next;
+    else dir->first = old->next;
+    if (old->next) ((entry*)old->next)->prev = old->prev;
+    else dir->last = old->prev;
+
+    struct inode* result = old->node;
+    retire(old, freeEntry);
+    return result;
+}
+
+/// Publishes `fresh` in place of the entry with the same name, at its position in the list and with its cookie,
+/// so that lookups and readdir racing with it find one of the two, the old one is freed after readers are done with it
+/// - Returns: pointer to the inode the old entry pointed at
+struct inode* placeEntry(directory* dir, entry* fresh) {
+    _Atomic(entry*)* slot = findSlot(dir->index, fresh->name, fresh->length, fresh->hash);
+    entry* old = *slot;
+    assert(old != NULL && old != Tombstone); // caller checks for existence
+
+    fresh->cookie = old->cookie;
+    fresh->prev = old->prev;
+    fresh->next = (entry*)old->next;
+    if (old->prev) old->prev->next = fresh;
+    else dir->first = fresh;
+    if (old->next) ((entry*)old->next)->prev = fresh;
+    else dir->last = fresh;
+    *slot = fresh;
+
+    // `old->next` stays intact for readers standing on it
+    struct inode* result = old->node;
+    retire(old, freeEntry);
+    return result;
+}
+
+/// Finds the first entry past `cookie`, in constant time if `at` is where the previous readdir stopped
+/// and that entry is still there. Entries added meanwhile come later, removed ones are skipped
+entry* seekEntry(directory* dir, uint64_t cookie, const cursor* at) {
+    if (cookie && at && at->cookie == cookie) {
+        entry* p = findEntry(dir, at->name, strlen(at->name));
+        if (p && p->cookie == cookie) return p->next;
+    }
+
+    entry* p = dir->first;
+    while (p && p->cookie <= cookie) p = p->next;
+    return p;
+}
+
+/// Remembers `p` as the last entry returned
+void moveCursor(cursor* at, const entry* p) {
+    at->cookie = p->cookie;
+    strcpy(at->name, p->name);
+}
+
+static void freeEntry(void* p) {
+    poolFree(&entryPools[entryClass(((entry*)p)->length)], p);
+}
+
+static slotTable* newTable(uint32_t capacity) {
+    slotTable* table = calloc(1, sizeof(slotTable) + capacity * sizeof(_Atomic(entry*)));
+    if (!table) return NULL;
+    table->capacity = capacity;
+    return table;
+}
+
+/// Finds the slot holding the entry, or the free slot where it would be inserted
+static _Atomic(entry*)* findSlot(slotTable* table, const char* name, size_t n, uint32_t hash) {
+    uint32_t mask = table->capacity - 1;
+    _Atomic(entry*)* vacant = NULL;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        entry* p = table->slots[i];
+        if (p == NULL) return vacant ? vacant : &table->slots[i];
+        if (p == Tombstone) {
+            if (!vacant) vacant = &table->slots[i];
+        } else if (p->hash == hash && p->length == n && memcmp(p->name, name, n) == 0) {
+            return &table->slots[i];
+        }
+    }
+}
+
+/// Publishes a new index with `capacity` slots, dropping tombstones, the old one is retired
+static bool rehash(directory* dir, uint32_t capacity) {
+    slotTable* table = newTable(capacity);
+    if (!table) return false;
+
+    uint32_t mask = capacity - 1;
+    for (entry* p = dir->first; p; p = p->next) {
+        uint32_t i = p->hash & mask;
+        while (table->slots[i]) i = (i + 1) & mask;
+        atomic_init(&table->slots[i], p);
+    }
+
+    slotTable* old = dir->index;
+    dir->index = table;
+    dir->used = dir->count;
+    countStat(StatSlots, (int64_t)capacity - old->capacity);
+    retire(old, free);
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef directory_h
+#define directory_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+struct inode;
+
+/// Entries are immutable once published, renames replace them with `placeEntry`.
+/// Names are stored inline, entries come from pools sized for names of up to 7, 15, ... `NAME_MAX` characters
+typedef struct entryTM { // apparently name `struct entry` is taken by some stupid search header
+    uint32_t hash;
+    uint32_t length; /// of the name, compared before the name itself
+    uint64_t cookie; /// readdir offset of the entry, grows along the list
+    struct inode* node;
+    _Atomic(struct entryTM*) next; /// readdir order, oldest first, still valid in a removed entry
+    struct entryTM* prev;
+    char name[];
+} entry;
+
+/// Open addressing index, replaced as a whole when it grows
+typedef struct slotTable {
+    uint32_t capacity; /// a power of two
+    _Atomic(entry*) slots[]; /// free slots are `NULL`, removed ones are tombstones
+} slotTable;
+
+/// Directory contents: entries in insertion order plus an index over them.
+/// Readers run lock free inside an epoch, writers are serialized by the caller
+typedef struct directory {
+    entry* first; /// always `.`, followed by `..`
+    entry* last;
+    _Atomic(slotTable*) index;
+    uint32_t count; /// live entries
+    uint32_t used; /// live entries and tombstones
+    uint64_t cookies; /// last one handed out
+} directory;
+
+/// Where a readdir handle stopped, so that the next call resumes without a scan
+typedef struct cursor {
+    uint64_t cookie; /// of the last entry returned, `0` before the first one
+    char name[NAME_MAX + 1];
+} cursor;
+
+uint32_t hashName(const char* name, size_t n);
+
+size_t entryFootprint(size_t n);
+size_t directoryFootprint(void);
+
+directory* newDirectory(void);
+void releaseDirectory(directory* dir);
+void retireDirectory(directory* dir);
+
+entry* findEntry(directory* dir, const char* name, size_t n);
+entry* findHashed(directory* dir, const char* name, size_t n, uint32_t hash);
+entry* newEntry(const char* name, size_t n, struct inode* node);
+void dropEntry(entry* p);
+entry* addEntry(directory* dir, const char* name, size_t n, struct inode* node);
+struct inode* placeEntry(directory* dir, entry* fresh);
+struct inode* removeEntry(directory* dir, const char* name);
+entry* seekEntry(directory* dir, uint64_t cookie, const cursor* at);
+void moveCursor(cursor* at, const entry* p);
+
+#endif /* directory_h */
@@ -0,0 +1,229 @@
+#include "Epoch.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define ReclaimBatch 64
+/// Past this many items waiting, retiring threads free them again themselves, so that memory stays bounded
+#define MaxLimbo (ReclaimBatch * 1024)
+/// How long the reclaimer waits for readers to move on before it tries again
+#define ReclaimInterval 10 // milliseconds
+
+/// Per thread record, reused after the thread exits
+typedef struct reader {
+    _Atomic uint64_t epoch; /// global epoch at entry, `0` outside
+    atomic_bool taken;
+    unsigned depth; /// nesting, only touched by the owner
+    struct reader* next;
+} reader;
+
+typedef struct retired {
+    void* object;
+    void (*release)(void*);
+    uint64_t epoch;
+    struct retired* next;
+} retired;
+
+static _Atomic uint64_t globalEpoch = 1;
+static _Atomic(reader*) readers;
+static _Thread_local reader* self;
+static pthread_key_t selfKey;
+static pthread_once_t selfKeyOnce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t limboLock = PTHREAD_MUTEX_INITIALIZER;
+static retired* limbo; /// oldest first
+static retired* limboTail;
+static size_t nlimbo;
+
+/// Background thread freeing what is retired, guarded by `limboLock`
+static struct {
+    pthread_cond_t wake;
+    bool running;
+    bool stopping;
+    pthread_t thread;
+} reclaimer = { .wake = PTHREAD_COND_INITIALIZER };
+
+static reader* registerReader(void);
+static bool tryAdvance(void);
+static retired* detachReclaimable(size_t max);
+static void releaseList(retired* list);
+
+/// Starts a read side critical section, nothing retired after this point is freed until `exitEpoch`
+void enterEpoch(void) {
+    reader* r = self ? self : registerReader();
+    if (r->depth++) return;
+
+    uint64_t e;
+    do {
+        e = atomic_load(&globalEpoch);
+        atomic_store(&r->epoch, e);
+        atomic_thread_fence(memory_order_seq_cst);
+    } while (e != atomic_load(&globalEpoch));
+}
+
+void exitEpoch(void) {
+    if (--self->depth) return;
+    atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+/// Frees `object` with `release` once every reader that could have seen it is gone, it has to be unreachable already
+void retire(void* object, void (*release)(void*)) {
+    retired* item = malloc(sizeof(retired));
+    if (!item) return; // leaking is the only safe option left
+
+    item->object = object;
+    item->release = release;
+    item->next = NULL;
+
+    pthread_mutex_lock(&limboLock);
+    item->epoch = atomic_load(&globalEpoch);
+    if (limboTail) limboTail->next = item;
+    else limbo = item;
+    limboTail = item;
+
+    retired* ready = NULL;
+    if (++nlimbo >= ReclaimBatch && reclaimer.running && nlimbo < MaxLimbo) {
+        if (nlimbo % ReclaimBatch == 0) pthread_cond_signal(&reclaimer.wake);
+    } else if (nlimbo >= ReclaimBatch) {
+        tryAdvance();
+        ready = detachReclaimable(SIZE_MAX);
+    }
+    pthread_mutex_unlock(&limboLock);
+
+    releaseList(ready);
+}
+
+/// Frees everything retired so far, only valid when no readers are left
+void reclaimAll(void) {
+    pthread_mutex_lock(&limboLock);
+    retired* list = limbo;
+    limbo = limboTail = NULL;
+    nlimbo = 0;
+    pthread_mutex_unlock(&limboLock);
+
+    releaseList(list);
+}
+
+/// Frees what was retired in batches of `ReclaimBatch`, dropping the lock in between, and waits when nothing is ready
+static void* reclaimLoop(void* arg) {
+    pthread_mutex_lock(&limboLock);
+    while (!reclaimer.stopping) {
+        tryAdvance();
+        retired* ready = detachReclaimable(ReclaimBatch);
+        if (!ready) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += ReclaimInterval * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&reclaimer.wake, &limboLock, &until);
+            continue;
+        }
+        pthread_mutex_unlock(&limboLock);
+        releaseList(ready);
+        pthread_mutex_lock(&limboLock);
+    }
+    pthread_mutex_unlock(&limboLock);
+    return NULL;
+}
+
+/// Moves freeing of retired objects out of the threads retiring them, into a thread of its own
+/// - Returns: `false` if the thread cannot be started, retiring threads keep freeing then
+bool startReclaimer(void) {
+    pthread_mutex_lock(&limboLock);
+    bool ok = reclaimer.running || pthread_create(&reclaimer.thread, NULL, reclaimLoop, NULL) == 0;
+    reclaimer.running = ok;
+    reclaimer.stopping = false;
+    pthread_mutex_unlock(&limboLock);
+    return ok;
+}
+
+/// Waits for the batch being freed and stops the thread, what is left goes with the next `retire` or `reclaimAll`
+void stopReclaimer(void) {
+    pthread_mutex_lock(&limboLock);
+    if (!reclaimer.running) {
+        pthread_mutex_unlock(&limboLock);
+        return;
+    }
+    reclaimer.stopping = true;
+    pthread_cond_signal(&reclaimer.wake);
+    pthread_mutex_unlock(&limboLock);
+
+    pthread_join(reclaimer.thread, NULL);
+    pthread_mutex_lock(&limboLock);
+    reclaimer.running = false;
+    pthread_mutex_unlock(&limboLock);
+}
+
+static void unregisterReader(void* r) {
+    atomic_store(&((reader*)r)->taken, false);
+}
+
+static void makeSelfKey(void) {
+    pthread_key_create(&selfKey, unregisterReader);
+}
+
+/// Claims a record left by an exited thread or pushes a new one
+static reader* registerReader(void) {
+    pthread_once(&selfKeyOnce, makeSelfKey);
+
+    reader* r = atomic_load(&readers);
+    for (; r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->taken, &expected, true)) break;
+    }
+
+    if (!r) {
+        r = calloc(1, sizeof(reader));
+        if (!r) abort(); // readers cannot fail
+        atomic_store(&r->taken, true);
+        r->next = atomic_load(&readers);
+        while (!atomic_compare_exchange_weak(&readers, &r->next, r));
+    }
+
+    pthread_setspecific(selfKey, r);
+    self = r;
+    return r;
+}
+
+/// Moves the global epoch forward if every active reader has seen the current one, called under `limboLock`
+static bool tryAdvance(void) {
+    uint64_t e = atomic_load(&globalEpoch);
+    for (reader* r = atomic_load(&readers); r; r = r->next) {
+        uint64_t seen = atomic_load(&r->epoch);
+        if (seen && seen != e) return false;
+    }
+    atomic_store(&globalEpoch, e + 1);
+    return true;
+}
+
+/// Unlinks up to `max` items retired at least two epochs ago, called under `limboLock`
+static retired* detachReclaimable(size_t max) {
+    uint64_t e = atomic_load(&globalEpoch);
+    retired *head = limbo, *last = NULL;
+    for (retired* p = limbo; p && p->epoch + 2 <= e && max; p = p->next, --max) {
+        last = p;
+        nlimbo--;
+    }
+    if (!last) return NULL;
+
+    limbo = last->next;
+    if (!limbo) limboTail = NULL;
+    last->next = NULL;
+    return head;
+}
+
+static void releaseList(retired* list) {
+    while (list) {
+        retired* next = list->next;
+        list->release(list->object);
+        free(list);
+        list = next;
+    }
+}
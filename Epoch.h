@@ -0,0 +1,19 @@
+#ifndef epoch_h
+#define epoch_h
+
+#include <stdbool.h>
+
+/// Epoch based reclamation: readers run inside `enterEpoch`/`exitEpoch` without locks,
+/// writers unpublish objects and `retire` them, they are freed once no reader can still see them,
+/// by the writers themselves or by a background reclaimer
+
+void enterEpoch(void);
+void exitEpoch(void);
+
+void retire(void* object, void (*release)(void*));
+void reclaimAll(void);
+
+bool startReclaimer(void);
+void stopReclaimer(void);
+
+#endif /* epoch_h */
@@ -1,196 +1,743 @@
 #include "Filesystem.h"
+#include "Pool.h"
+#include "Journal.h"
+#include "Stats.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/// Name in a path, taken in place along with what `findHashed` needs
+typedef struct component {
+    const char* name; /// not terminated, the rest of the path follows
+    size_t length;
+    uint32_t hash;
+} component;
 
 static int checkPath(const char* path);
-static int extractPrefix(char* result, const char* path);
+static bool nextComponent(const char** path, component* c);
+static inode* walkPath(const char* path, inode* root, component* leaf);
 static bool isEmpty(inode* dir);
+static bool isDots(const char* name);
+static bool canReplace(inode* node, inode* old, inode* newDirNode);
+static void removeDirectory(inode* node);
+static void discardDirectory(inode* node);
 static inode* getParentDirectory(const char* path, const char** name, inode* root);
+static bool isCacheable(const char* path);
+static void forgetPath(const char* path, Filesystem* fs);
+static bool countReferences(inode* node, int links, int opens, int64_t lookups);
+static void freeNode(inode* node);
+static void freeNodeObject(void* node);
+static bool numberNode(inodeTable* numbers, inode* node);
+static void unnumberNode(inode* node);
+static bool checkRange(size_t size, off_t offset);
+#ifdef PageCompression
+static void touchNode(inode* node);
+static void* packLoop(void* arg);
+#endif
+
+static pool inodes = PoolInit(sizeof(inode));
+
+/// Memory an inode takes, with its slot in the `inodeTable`
+#define InodeFootprint (inodes.size + sizeof(numberSlot))
 
-/// Traverse directories starting from `root` according to `path`
+/// Traverse directories starting from `root` according to `path`, lock free inside an epoch
 /// - Returns: `NULL` if search failed, pointer to the found `indoe` otherwise
 inode* pathfind(const char* path, inode* root) {
-    if (*path == Split) path++; // optional / at the start
-    if (!*path) return root;
+    return walkPath(path, root, NULL);
+}
 
-    if (!isDir(root)) {
-        fprintf(stderr, "Name previous to '%s', is not a directory\n", path);
-        errno = ENOTDIR;
-        return NULL;
+/// Finds the inode numbered `ino`, one the kernel was told about and did not forget yet
+/// - Returns: `NULL` with `ENOENT` if no inode has that number
+inode* numberedNode(Filesystem* fs, uint64_t ino) {
+    numberSlot* chunk = ino <= MaxIno ? fs->numbers.chunks[ino >> ChunkShift] : NULL;
+    inode* node = chunk ? chunk[ino & ChunkMask].node : NULL;
+    if (!node) errno = ENOENT;
+    return node;
+}
+
+/// Same as `pathfind` from the root of `fs`, but remembers the outcome for the next call with the same `path`
+/// - Returns: `NULL` if search failed, pointer to the found `inode` otherwise
+inode* lookupNode(const char* path, Filesystem* fs) {
+    size_t n = strlen(path);
+    uint32_t hash = hashName(path, n);
+    _Atomic(dentry*)* slot = &fs->table[hash % NBuckets];
+    uint32_t epoch = fs->epoch;
+
+    dentry* d = *slot;
+    if (d && d->hash == hash && d->epoch == epoch && strcmp(d->path, path) == 0) {
+        countStat(StatPathHits, 1);
+        if (!d->node) errno = ENOENT;
+        return d->node;
     }
+    countStat(StatPathMisses, 1);
 
-    int n = 0;
-    for (; path[n] != '\0' && path[n] != Split; ++n);
+    uint64_t changes = fs->changes;
+    inode* node = pathfind(path, fs->root);
+    if (!node && errno != ENOENT) return NULL;
+    // odd while a writer is changing the tree, what was found might be gone or missing already
+    if (changes % 2 || !isCacheable(path)) return node;
 
-    for (entry* p = root->data; p; p = p->next)
-        if (strlen(p->name) == n && strncmp(path, p->name, n) == 0)
-            return pathfind(path + n, p->node);
+    dentry* copy = malloc(sizeof(dentry) + n + 1);
+    if (!copy) return node; // not worth failing the lookup for
+    copy->hash = hash;
+    copy->epoch = epoch;
+    copy->node = node;
+    memcpy(copy->path, path, n + 1);
 
-    errno = ENOENT;
-    return NULL;
+    d = atomic_exchange(slot, copy);
+    if (d) retire(d, free);
+
+    // a writer might have missed this entry while forgetting the path, take it back
+    dentry* expected = copy;
+    if (fs->changes != changes && atomic_compare_exchange_strong(slot, &expected, NULL))
+        retire(copy, free);
+
+    if (!node) errno = ENOENT;
+    return node;
 }
 
-/// Allocates new entry in the `list` with `name`
-/// - Returns the pointer to it, or `NULL` if error occurs
-entry* addEntry(entry* list, const char* name) {
-    while (list->next) list = list->next;
-    list->next = calloc(1, sizeof(entry));
-    entry* result = list->next;
-    if (!result) {
-        errno = ENOSPC;
+#define errorFree(call) if ((call) < 0) return NULL;
+
+/// Adds `node` to the `dirNode` directory under `name`, a new directory gets its `.` and `..` first
+/// - Returns: pointer to the added inode (just in case), `NULL` on error, `ENOENT` if `dirNode` was removed
+inode* linkNode(inode* dirNode, const char* name, inode* node) {
+    if (!asDir(dirNode)) {
+        errno = ENOENT;
+        return NULL;
+    }
+    size_t n = strlen(name);
+    if (findEntry(asDir(dirNode), name, n)) {
+        errno = EEXIST;
         return NULL;
     }
 
-    strcpy(result->name, name);
+    if (!charge(node->quota, entryFootprint(n))) return NULL;
+    bool orphan = !node->parent;
+    if (orphan) node->parent = dirNode;
+    // a new directory gets its contents before anyone can find it, or is not linked at all
+    bool created = isDir(node) && !asDir(node);
+    if (created && !initDirectory(node)) {
+        if (orphan) node->parent = NULL;
+        refund(node->quota, entryFootprint(n));
+        return NULL;
+    }
+    // counted before publishing, so that a racing lookup and forget cannot retire it
+    countReferences(node, 1, 0, 0);
+
+    if (!addEntry(asDir(dirNode), name, n, node)) {
+        if (created) discardDirectory(node);
+        writeLock(node);
+        node->nlink--; // nobody has seen this link, leave the rest to the caller
+        unlock(node);
+        refund(node->quota, entryFootprint(n));
+        return NULL;
+    }
+    journalLink(dirNode, name, node);
 
-    return result;
+    return node;
 }
 
-/// Deletes `name`d entry in the `list`
-/// - Returns: if entry was found, pointer to the corresponding inode, `NULL` otherwise
-inode* removeEntry(entry* list, const char* name) {
-    for (entry* p = list; p->next; p = p->next)
-        if (strcmp(name, p->next->name) == 0) {
-            inode* result = p->next->node;
-            entry* old = p->next;
-            p->next = p->next->next;
-            free(old);
-            return result;
+/// Moves `name`d entry of `dirNode` to `newDirNode` under `newName` the way `rename` does: whatever was there goes,
+/// in place so that lookups racing with it find one inode or the other, and a moved directory gets its `..` and
+/// `parent` updated. Nothing changes on error
+/// - Returns: pointer to the moved inode, `NULL` on error
+inode* relinkNode(inode* dirNode, const char* name, inode* newDirNode, const char* newName) {
+    if (isDots(name) || isDots(newName)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t n = strlen(newName);
+    entry* p = findEntry(asDir(dirNode), name, strlen(name));
+    if (!p) return NULL;
+    inode* node = p->node;
+    entry* target = findEntry(asDir(newDirNode), newName, n);
+    if (target && target->node == node) return node; // links of the same inode, `rename` leaves both
+    if (!canReplace(node, target ? target->node : NULL, newDirNode)) return NULL;
+
+    // whatever can fail comes first
+    bool moving = isDir(node) && dirNode != newDirNode;
+    entry* dots = moving ? newEntry("..", 2, newDirNode) : NULL;
+    entry* fresh = target && (!moving || dots) ? newEntry(newName, n, node) : NULL;
+    bool ok = (!moving || dots) && (!target || fresh);
+    if (ok && !target) {
+        ok = charge(node->quota, entryFootprint(n));
+        if (ok && !addEntry(asDir(newDirNode), newName, n, node)) {
+            refund(node->quota, entryFootprint(n));
+            ok = false;
         }
-    errno = ENOENT;
-    return NULL;
+    }
+    if (!ok) {
+        if (dots) dropEntry(dots);
+        if (fresh) dropEntry(fresh);
+        return NULL;
+    }
+
+    if (target) {
+        inode* old = placeEntry(asDir(newDirNode), fresh);
+        if (isDir(old)) removeDirectory(old);
+        countReferences(old, -1, 0, 0);
+    }
+    removeEntry(asDir(dirNode), name);
+    refund(node->quota, entryFootprint(strlen(name)));
+    if (moving) {
+        placeEntry(asDir(node), dots);
+        node->parent = newDirNode;
+        countReferences(newDirNode, 1, 0, 0);
+        countReferences(dirNode, -1, 0, 0);
+    }
+    journalRename(dirNode, name, newDirNode, newName);
+
+    return node;
 }
 
-#define errorFree(call) if ((call) < 0) return NULL;
+/// Removes `name`d entry of `dirNode`, either regular file or an empty directory, the inode is dropped if nothing references it
+/// - Returns: `true` if successful, `false` if error
+bool unlinkNode(inode* dirNode, const char* name) {
+    entry* p = findEntry(asDir(dirNode), name, strlen(name));
+    if (!p) return false;
+    inode* node = p->node;
 
-/// Adds `node` to the `path` location, starting from `root` inode
-/// - Returns: pointer to the added inode (just in case), `NULL` on error
-inode* addNode(const char* path, inode* root, inode* node) {
-    const char* file;
-    inode* dirNode = getParentDirectory(path, &file, root);
-    if (!dirNode) return NULL;
+    if (isDir(node)) {
+        if (!isEmpty(node)) {
+            errno = ENOTEMPTY;
+            return false;
+        }
+        removeDirectory(node);
+    }
 
-    if (pathfind(file, dirNode)) {
-        errno = EEXIST;
+    journalUnlink(dirNode, name);
+    removeEntry(asDir(dirNode), name);
+    refund(node->quota, entryFootprint(strlen(name)));
+    countReferences(node, -1, 0, 0);
+
+    return true;
+}
+
+/// Allocates a new unlinked inode, charged to `fs` along with everything it gets later
+/// - Returns: `NULL` if out of memory or over the limits of `fs`
+inode* newNode(Filesystem* fs, mode_t mode, uid_t uid, gid_t gid) {
+    if (!chargeInode(&fs->quota, InodeFootprint)) return NULL;
+    inode* node = poolAlloc(&inodes);
+    if (!node || !numberNode(&fs->numbers, node)) {
+        if (node) poolFree(&inodes, node);
+        refundInode(&fs->quota, InodeFootprint);
+        errno = ENOSPC;
         return NULL;
     }
+    pthread_rwlock_init(&node->lock, NULL);
+    node->quota = &fs->quota;
+    node->journal = fs->journal;
+    node->serial = atomic_fetch_add(&fs->serials, 1) + 1;
+    node->mode = mode;
+    node->uid = uid;
+    node->gid = gid;
 
-    entry* p = addEntry(dirNode->data, file);
-    if (!p) return NULL;
-    
-    node->nlink++;
-    if (!node->parent) node->parent = dirNode;
+#ifdef PageCompression
+    if (S_ISREG(mode)) {
+        touchNode(node);
+        node->packer = &fs->packer;
+        pthread_mutex_lock(&fs->packer.lock);
+        node->nextFile = fs->packer.files;
+        if (node->nextFile) node->nextFile->prevFile = node;
+        fs->packer.files = node;
+        pthread_mutex_unlock(&fs->packer.lock);
+    }
+#endif
+    return node;
+}
 
-    p->node = node;
+/// Counts an open file handle of the `node`
+/// - Returns: `false` if the `node` found by a lock free lookup is already gone
+bool openNode(inode* node) {
+    return countReferences(node, 0, 1, 0);
+}
+
+/// Drops an open file handle, the inode goes away here if it was unlinked while open
+void closeNode(inode* node) {
+    countReferences(node, 0, -1, 0);
+}
+
+/// Counts a lookup reference the kernel holds until it forgets the `node`
+/// - Returns: `false` if the `node` found by a lock free lookup is already gone
+bool pinNode(inode* node) {
+    return countReferences(node, 0, 0, 1);
+}
+
+void forgetNode(inode* node, uint64_t nlookup) {
+    countReferences(node, 0, 0, -(int64_t)nlookup);
+}
+
+/// Frees the `node` if there are no links, open files or kernel lookups left referencing it
+void dropNode(inode* node) {
+    countReferences(node, 0, 0, 0);
+}
+
+/// Adds `node` to the `path` location
+/// - Returns: pointer to the added inode (just in case), `NULL` on error
+inode* addNode(const char* path, Filesystem* fs, inode* node) {
+    const char* file;
+    inode* dirNode = getParentDirectory(path, &file, fs->root);
+    if (!dirNode) return NULL;
+
+    fs->changes++;
+    inode* linked = linkNode(dirNode, file, node);
+    fs->changes++;
+    if (!linked) return NULL;
+    forgetPath(path, fs);
 
     return node;
 }
 
-inode* moveNode(const char* path, const char* newpath, inode* root) {
+/// Renames `path` to `newpath`, see `relinkNode`, both parents are looked up once
+/// - Returns: pointer to the moved inode, `NULL` on error
+inode* moveNode(const char* path, const char* newpath, Filesystem* fs) {
     const char *oldFile, *newFile;
-    inode* oldDirNode = getParentDirectory(path, &oldFile, root);
+    inode* oldDirNode = getParentDirectory(path, &oldFile, fs->root);
     if (!oldDirNode) return NULL;
-    inode* newDirNode = getParentDirectory(newpath, &newFile, root);
+    inode* newDirNode = getParentDirectory(newpath, &newFile, fs->root);
     if (!newDirNode) return NULL;
 
-    inode* node = removeEntry(oldDirNode->data, oldFile);
+    fs->changes++;
+    inode* node = relinkNode(oldDirNode, oldFile, newDirNode, newFile);
+    fs->changes++;
     if (!node) return NULL;
 
-    entry* p = addEntry(newDirNode->data, newFile);
-    if (!p) return NULL;
-
-    p->node = node;
+    // every cached path going through a moved or replaced directory is wrong now
+    if (isDir(node)) fs->epoch++;
+    forgetPath(path, fs);
+    forgetPath(newpath, fs);
 
     return node;
 }
 
 /// Unlinks an inode from `path`, if 0 links left, deletes the inode, either regular file or an empty directory
 /// - Returns: `true` if successful, `false` if error
-bool releaseNode(const char* path, inode* root) {
+bool releaseNode(const char* path, Filesystem* fs) {
     const char* file;
-    inode* dirNode = getParentDirectory(path, &file, root);
-    if (!dirNode) return NULL;
+    inode* dirNode = getParentDirectory(path, &file, fs->root);
+    if (!dirNode) return false;
 
-    inode* node = pathfind(file, dirNode);
+    fs->changes++;
+    bool unlinked = unlinkNode(dirNode, file);
+    fs->changes++;
+    if (!unlinked) return false;
+    forgetPath(path, fs);
 
-    // if it is an empty directory, remove .. to correctly free the list
-    if (isDir(node)) {
-        if (!isEmpty(node)) {
-            errno = ENOTEMPTY;
-            return false;
-        }
-        assert(node->nlink == 2); // . and itself
-        removeEntry(node->data, "..");
-        dirNode->nlink--; // cause .. was referencing it
-        assert(((entry*)node->data)->next == NULL);
-        free(node->data);
-        free(node);
-    } else if (--node->nlink == 0 && !node->nopen) {
-        // file needs to be closed and with 0 links
-        if (node->data) free(node->data);
-        free(node);
+    return true;
+}
+
+/// Read locks `node` for reading `size` bytes at `offset`. If some of the pages there are packed,
+/// they are unpacked and the lock is a write one instead, either way `unlock` releases it
+/// - Returns: `false` with `node` unlocked if pages could not be unpacked
+bool lockRange(inode* node, size_t size, off_t offset) {
+    readLock(node);
+#ifdef PageCompression
+    if (!isFile(node)) return true;
+    touchNode(node);
+    if (!storagePacked(&node->file, size, offset)) return true;
+
+    // nothing else writes to the file meanwhile, the packer leaves it alone now that it is touched
+    unlock(node);
+    writeLock(node);
+    node->packed = false;
+    if (!storageUnpack(&node->file, node->quota, size, offset)) {
+        unlock(node);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/// Fills in `statbuf` with attributes of the `node`
+void statNode(inode* node, struct stat* statbuf) {
+    statbuf->st_ino = node->ino;
+    statbuf->st_mode = node->mode;
+    statbuf->st_uid = node->uid;
+    statbuf->st_gid = node->gid;
+    statbuf->st_nlink = node->nlink;
+    statbuf->st_size = node->size;
+    statbuf->st_blocks = (blkcnt_t)((node->file.allocated + 511) / 512); // holes take no space
+}
+
+/// Copies up to `size` bytes of file contents at `offset` into `buf`, the `node` has to be locked with `lockRange`
+/// - Returns: number of bytes read, which is less than `size` near the end of file
+ssize_t readNode(inode* node, char* buf, size_t size, off_t offset) {
+    if (offset >= node->size) return 0;
+    if ((off_t)size > node->size - offset) size = (size_t)(node->size - offset);
+
+    storageRead(&node->file, buf, size, offset);
+
+    return size;
+}
+
+/// Same as `readNode`, but fills `vec` with pointers into the file contents, valid while the `node` stays locked
+/// - Returns: number of `vec` items used, at most `storageMapCapacity(size)`
+size_t mapNode(inode* node, struct iovec* vec, size_t size, off_t offset) {
+    if (offset >= node->size) return 0;
+    if ((off_t)size > node->size - offset) size = (size_t)(node->size - offset);
+
+    return storageMap(&node->file, vec, size, offset);
+}
+
+/// Writes `size` bytes from `buf` to the file at `offset`, extending it if needed
+/// - Returns: number of bytes written, `-1` on error
+ssize_t writeNode(inode* node, const char* buf, size_t size, off_t offset) {
+    if (!checkRange(size, offset)) return -1;
+#ifdef PageCompression
+    touchNode(node);
+    node->packed = false;
+#endif
+    if (!storageWrite(&node->file, node->quota, buf, size, offset)) {
+        // drop whatever got allocated past the end
+        storageTruncate(&node->file, node->quota, node->size);
+        return -1;
+    }
+    if (offset + (off_t)size > node->size) node->size = offset + (off_t)size;
+    node->version++;
+    journalWrite(node, buf, size, offset);
+
+    return size;
+}
+
+/// Allocates `size` bytes at `offset` and points `vec` at them, so the caller can write the file in place.
+/// Has to be followed by `commitNode` with the `node` still locked
+/// - Returns: number of `vec` items used, at most `storageMapCapacity(size)`, `-1` on error
+ssize_t reserveNode(inode* node, struct iovec* vec, size_t size, off_t offset) {
+    if (!checkRange(size, offset)) return -1;
+#ifdef PageCompression
+    touchNode(node);
+    node->packed = false;
+#endif
+    if (!storageReserve(&node->file, node->quota, size, offset)) {
+        storageTruncate(&node->file, node->quota, node->size);
+        return -1;
+    }
+    return (ssize_t)storageMap(&node->file, vec, size, offset);
+}
+
+/// Extends the file over the `written` out of `size` bytes reserved at `offset`, pages reserved past the end are dropped
+void commitNode(inode* node, size_t size, size_t written, off_t offset) {
+    if (written && offset + (off_t)written > node->size) node->size = offset + (off_t)written;
+    if (written < size) storageTruncate(&node->file, node->quota, node->size);
+    if (!written) return;
+    node->version++;
+    journalWritten(node, written, offset);
+}
+
+/// Finds next data or hole in the file, for `lseek` with `SEEK_DATA` or `SEEK_HOLE`
+/// - Returns: the found offset, `-1` on error
+off_t seekNode(inode* node, off_t offset, int whence) {
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        errno = EINVAL;
+        return -1;
     }
+    return storageSeek(&node->file, offset, whence, node->size);
+}
 
-    node = removeEntry(dirNode->data, file);
-    if (!node) return false;
+/// Cuts or zero extends the file to `offset` bytes
+/// - Returns: `false` on error
+bool truncateNode(inode* node, off_t offset) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return false;
+    }
+#ifdef PageCompression
+    node->packed = false;
+#endif
+    if (offset < node->size) storageTruncate(&node->file, node->quota, offset);
+    if (offset != node->size) node->version++;
+    node->size = offset;
+    journalTruncate(node);
 
     return true;
 }
 
-Filesystem* newFilesystem(void) {
-    Filesystem* fs = malloc(sizeof(Filesystem));
-    inode* root = calloc(1, sizeof(inode));
-    root->mode = S_IRWXO | S_IRWXG | S_IRWXU | S_IFDIR;
-    root->nlink = 1;
-    root->parent = root;
+/// Shares pages with the same contents as pages of other files, if anything changed since the last time
+void dedupNode(inode* node) {
+    if (!isFile(node) || node->dedupedVersion == node->version) return;
+    storageDedup(&node->file, node->quota);
+    node->dedupedVersion = node->version;
+}
 
-    entry* ddot = malloc(sizeof(entry));
-    strcpy(ddot->name, "..");
-    ddot->node = root;
-    root->nlink++;
-    ddot->next = NULL;
+/// Turns `node` into a copy of `from` that shares all its pages, without copying any data.
+/// Both have to be locked, `node` for writing
+/// - Returns: `false` if out of memory or over the quota, `node` is left empty then
+bool cloneNode(inode* node, inode* from) {
+    if (node == from) return true;
+    storageTruncate(&node->file, node->quota, 0);
+    node->size = 0;
+    node->version++;
+    journalTruncate(node);
 
-    entry* dot = malloc(sizeof(entry));
-    strcpy(dot->name, ".");
-    dot->node = root;
-    root->nlink++;
-    dot->next = ddot;
+    size_t count = ((size_t)from->size + PageSize - 1) >> PageShift;
+    if (!storageClone(&node->file, node->quota, &from->file, count, 0, 0)) {
+        storageTruncate(&node->file, node->quota, 0);
+        return false;
+    }
+    node->size = from->size;
+    journalWritten(node, (size_t)node->size, 0); // replay cannot share pages, the data goes instead
+    return true;
+}
 
-    root->data = dot;
+/// Copies `size` bytes at `fromOffset` in `from` to `offset` in `node`, extending it if needed. Between page
+/// aligned offsets whole pages are shared rather than copied. Both have to be locked for writing, with `lockPair`
+/// if they differ, and the ranges cannot overlap within one file
+/// - Returns: number of bytes copied, less than `size` past the end of `from`, `-1` on error
+ssize_t copyNode(inode* node, off_t offset, inode* from, off_t fromOffset, size_t size) {
+    if (fromOffset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!checkRange(size, offset)) return -1;
+    if (!size || fromOffset >= from->size) return 0;
+    if ((off_t)size > from->size - fromOffset) size = (size_t)(from->size - fromOffset);
+    if (node == from && offset < fromOffset + (off_t)size && fromOffset < offset + (off_t)size) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef PageCompression
+    touchNode(node);
+    node->packed = false;
+#endif
+
+    // the last page goes too when the copy ends both files, bytes past the end of a page are zeros anyway
+    size_t pages = 0;
+    if (offset % PageSize == 0 && fromOffset % PageSize == 0) {
+        pages = size / PageSize;
+        if (fromOffset + (off_t)size == from->size && offset + (off_t)size >= node->size)
+            pages = (size + PageSize - 1) / PageSize;
+    }
+    size_t shared = pages * PageSize < size ? pages * PageSize : size, rest = size - shared;
+
+    bool ok = storageClone(&node->file, node->quota, &from->file, pages,
+                           (size_t)fromOffset / PageSize, (size_t)offset / PageSize);
+#ifdef PageCompression
+    ok = ok && storageUnpack(&from->file, from->quota, rest, fromOffset + (off_t)shared);
+#endif
+    ok = ok && storageCopy(&node->file, node->quota, &from->file, rest, fromOffset + (off_t)shared, offset + (off_t)shared);
+    if (!ok) {
+        storageTruncate(&node->file, node->quota, node->size);
+        return -1;
+    }
+    if (offset + (off_t)size > node->size) node->size = offset + (off_t)size;
+    node->version++;
+    journalWritten(node, size, offset);
+
+    return size;
+}
+
+/// `fallocate` of `length` bytes at `offset`: allocates the pages so that writing there cannot run out of memory,
+/// extending the file unless `FALLOC_FL_KEEP_SIZE`, or turns them into a hole with `FALLOC_FL_PUNCH_HOLE`
+/// - Returns: `false` on error, `EOPNOTSUPP` for other modes
+bool allocateNode(inode* node, int mode, off_t offset, off_t length) {
+    if (offset < 0 || length <= 0) {
+        errno = EINVAL;
+        return false;
+    }
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE) || mode == FALLOC_FL_PUNCH_HOLE) {
+        errno = EOPNOTSUPP; // punching has to keep the size, as in Linux
+        return false;
+    }
+    if (!checkRange((size_t)length, offset)) return false;
+#ifdef PageCompression
+    touchNode(node);
+    node->packed = false;
+#endif
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (offset >= node->size) return true;
+        if (length > node->size - offset) length = node->size - offset;
+        storagePunch(&node->file, node->quota, (size_t)length, offset);
+        node->version++;
+        journalAllocate(node, mode, offset, length);
+        return true;
+    }
+
+    // pages past the end only go with a truncation, or a write that fails
+    if (!storageReserve(&node->file, node->quota, (size_t)length, offset)) {
+        storageTruncate(&node->file, node->quota, node->size);
+        return false;
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > node->size) {
+        node->size = offset + length;
+        node->version++;
+    }
+    journalAllocate(node, mode, offset, length);
+    return true;
+}
+
+/// Write locks both inodes, in address order so that two threads locking the same pair cannot deadlock
+void lockPair(inode* a, inode* b) {
+    if (a == b) {
+        writeLock(a);
+        return;
+    }
+    writeLock(a < b ? a : b);
+    writeLock(a < b ? b : a);
+}
+
+void unlockPair(inode* a, inode* b) {
+    unlock(a);
+    if (a != b) unlock(b);
+}
+
+/// Tells if the pages the kernel cached since the previous open of the `node` are still good, and remembers the contents for the next one
+bool keepCache(inode* node) {
+    bool unchanged = node->cachedVersion == node->version;
+    node->cachedVersion = node->version;
+    countStat(unchanged ? StatKeptCaches : StatDroppedCaches, 1);
+    return unchanged;
+}
+
+/// Creates contents of the directory `node` with `.` and `..` entries, `node->parent` has to be set
+/// - Returns: `false` if out of memory
+bool initDirectory(inode* node) {
+    size_t footprint = directoryFootprint() + entryFootprint(1) + entryFootprint(2);
+    if (!charge(node->quota, footprint)) return false;
+    directory* dir = newDirectory();
+    if (!dir) {
+        refund(node->quota, footprint);
+        return false;
+    }
+
+    if (!addEntry(dir, ".", 1, node) || !addEntry(dir, "..", 2, node->parent)) {
+        releaseDirectory(dir);
+        refund(node->quota, footprint);
+        errno = ENOSPC;
+        return false;
+    }
+
+    countReferences(node, 1, 0, 0);
+    countReferences(node->parent, 1, 0, 0);
+
+    node->data = dir;
+    return true;
+}
+
+/// Creates an empty filesystem holding at most `maxBytes` of memory and `maxInodes` inodes, `0` for no limit
+Filesystem* newFilesystem(size_t maxBytes, size_t maxInodes) {
+    Filesystem* fs = calloc(1, sizeof(Filesystem));
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->numbers.lock, NULL);
+    fs->quota.maxBytes = maxBytes;
+    fs->quota.maxInodes = maxInodes;
+#ifdef PageCompression
+    pthread_mutex_init(&fs->packer.lock, NULL);
+    pthread_cond_init(&fs->packer.wake, NULL);
+#endif
+
+    inode* root = newNode(fs, S_IRWXO | S_IRWXG | S_IRWXU | S_IFDIR, 0, 0);
+    root->nlink = 1;
+    root->parent = root;
+
+    initDirectory(root);
     fs->root = root;
 
     return fs;
 }
 
-void releaseAll(inode* root) {
-    root->nlink--;
-    if (root->traversing) return;
-    root->traversing = true;
+/// Reports usage against the limits, memory of the machine stands for a missing byte limit
+void statFilesystem(Filesystem* fs, struct statvfs* st) {
+    size_t unit = (size_t)sysconf(_SC_PAGESIZE);
+    size_t capacity = fs->quota.maxBytes ? fs->quota.maxBytes : (size_t)sysconf(_SC_PHYS_PAGES) * unit;
+    size_t used = atomic_load(&fs->quota.bytes);
+    size_t available = capacity > used ? capacity - used : 0;
+    size_t inodeCount = atomic_load(&fs->quota.inodes);
 
-    if (root->nopen) fprintf(stderr, "Warning: releasing an open file\n");
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = st->f_frsize = unit;
+    st->f_blocks = capacity / unit;
+    st->f_bfree = st->f_bavail = available / unit;
+    // without an inode limit every new inode still needs memory
+    if (fs->quota.maxInodes) st->f_ffree = fs->quota.maxInodes > inodeCount ? fs->quota.maxInodes - inodeCount : 0;
+    else st->f_ffree = available / InodeFootprint;
+    st->f_files = inodeCount + st->f_ffree;
+    st->f_favail = st->f_ffree;
+    st->f_namemax = NAME_MAX;
+}
 
-    if (isDir(root)) {
-        entry* p = root->data;
-        while (p->next) {
-            releaseAll(p->next->node);
-            entry* old = p->next;
-            p->next = p->next->next;
-            free(old);
-        }
-        releaseAll(p->node);
+#ifdef PageCompression
+/// Starts packing files not accessed for `after` seconds in the background
+/// - Returns: `false` if the thread could not be started
+bool startPacker(Filesystem* fs, unsigned after) {
+    fs->packer.after = after;
+    fs->packer.stopping = false;
+    if (pthread_create(&fs->packer.thread, NULL, packLoop, fs) == 0) return true;
+    fs->packer.after = 0;
+    return false;
+}
+
+/// Waits for the file being packed and stops the thread
+void stopPacker(Filesystem* fs) {
+    if (!fs->packer.after) return;
+    pthread_mutex_lock(&fs->packer.lock);
+    fs->packer.stopping = true;
+    pthread_cond_broadcast(&fs->packer.wake);
+    pthread_mutex_unlock(&fs->packer.lock);
+    pthread_join(fs->packer.thread, NULL);
+    fs->packer.after = 0;
+}
+
+/// Formats the `PackingAttribute` of `node` the way `getxattr` returns it: bytes of its pages when
+/// unpacked, what they take now and the ratio, only the length is returned if `size` is `0`
+/// - Returns: length of the value, `-1` with `ERANGE` if it does not fit in `size`
+ssize_t packingAttribute(inode* node, char* buf, size_t size) {
+    char value[96];
+    size_t stored = node->file.allocated;
+    size_t unpacked = stored - node->file.packedLength + node->file.packed;
+    int n = snprintf(value, sizeof(value), "unpacked=%zu stored=%zu ratio=%.2f",
+                     unpacked, stored, stored ? (double)unpacked / stored : 1.0);
+    if (size && (size_t)n > size) {
+        errno = ERANGE;
+        return -1;
     }
+    if (size) memcpy(buf, value, (size_t)n);
+    return n;
+}
+#endif
 
-    root->traversing = false;
-    if (root->nlink == 0) {
-        if (root->data) free(root->data);
-        free(root);
+/// Frees every inode of `fs` by number, without walking the tree, those unlinked while open included.
+/// Only valid once nothing uses the filesystem anymore and what was retired is freed
+void releaseAll(Filesystem* fs) {
+    inodeTable* numbers = &fs->numbers;
+    for (uint32_t ino = 1; ino <= numbers->last; ++ino) {
+        inode* node = numbers->chunks[ino >> ChunkShift][ino & ChunkMask].node;
+        if (!node) continue;
+        if (node->nopen) fprintf(stderr, "Warning: releasing an open file\n");
+        freeNode(node);
     }
 }
 
+void releaseFilesystem(Filesystem* fs) {
+    if (fs->journal) closeJournal(fs->journal);
+#ifdef PageCompression
+    stopPacker(fs);
+#endif
+    stopReclaimer();
+    reclaimAll(); // no readers are left at this point, retired inodes leave the table
+    releaseAll(fs);
+    for (int i = 0; i < NBuckets; ++i)
+        free(fs->table[i]);
+    reclaimAll();
+    if (fs->image) munmap(fs->image, fs->imageLength); // nothing points into it anymore
+    for (int i = 0; i < NChunks; ++i)
+        free(fs->numbers.chunks[i]);
+    pthread_mutex_destroy(&fs->numbers.lock);
+#ifdef PageCompression
+    pthread_mutex_destroy(&fs->packer.lock);
+    pthread_cond_destroy(&fs->packer.wake);
+#endif
+    pthread_rwlock_destroy(&fs->lock);
+    free(fs);
+}
+
 static int checkPath(const char* path) {
     if (!*path) {
         errno = ENOENT;
@@ -203,47 +750,297 @@ static int checkPath(const char* path) {
     return 0;
 }
 
-static int extractPrefix(char* result, const char* path) {
-    strcpy(result, path);
-
-    int n = (int)strlen(result);
-    while (result[--n] != Split) assert(n >= 0);
-    result[n] = '\0';
+/// Takes the component after the optional / at `path`, hashing it while looking for its end, and moves `path` past it
+/// - Returns: `false` at the end of the path
+static bool nextComponent(const char** path, component* c) {
+    const char* p = *path;
+    if (*p == Split) p++;
+    if (!*p) return false;
 
-    if (strlen(result) - n == 1) {
-        fprintf(stderr, "filename for '%s' is empty", path);
-        errno = ENOENT;
-        return -1;
+    uint32_t hash = 2166136261u; // `hashName`
+    const char* name = p;
+    for (; *p && *p != Split; ++p) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
     }
+    *c = (component){ name, (size_t)(p - name), hash };
+    *path = p;
+    return true;
+}
 
-    return n;
+/// Same as `pathfind`, in one pass over `path` and without recursion. With `leaf` the last component is not
+/// followed but left there, and the directory holding it is returned, `leaf` stays empty if the path ends with /
+static inode* walkPath(const char* path, inode* root, component* leaf) {
+    if (leaf) *leaf = (component){ path, 0, 0 };
+    inode* node = root;
+    for (component c; nextComponent(&path, &c);) {
+        if (leaf && !*path) {
+            *leaf = c;
+            return node;
+        }
+
+        if (!isDir(node)) {
+            fprintf(stderr, "Name previous to '%s', is not a directory\n", c.name);
+            errno = ENOTDIR;
+            return NULL;
+        }
+
+        directory* dir = asDir(node);
+        if (!dir) { // being created or removed
+            errno = ENOENT;
+            return NULL;
+        }
+
+        entry* p = findHashed(dir, c.name, c.length, c.hash);
+        if (!p) return NULL;
+        node = p->node;
+    }
+    return node;
 }
 
 /// Checks if directory is empty (if only . and .. are its members)
 static bool isEmpty(inode* dir) {
-    int n = 0;
-    for (entry* p = dir->data; p; p = p->next)
-        if (++n > 2) return false;
-    assert(n == 2); // can't be less
+    assert(asDir(dir)->count >= 2); // can't be less
+    return asDir(dir)->count == 2;
+}
+
+static bool isDots(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/// Tells if `node` can be moved to `newDirNode` in place of `old`, `NULL` if the name is free there
+static bool canReplace(inode* node, inode* old, inode* newDirNode) {
+    // a directory cannot go inside itself, `parent` links lead to the root whose parent is itself
+    if (isDir(node)) {
+        for (inode* p = newDirNode;; p = p->parent) {
+            if (p == node) {
+                errno = EINVAL;
+                return false;
+            }
+            if (p->parent == p) break;
+        }
+    }
+    if (!old) return true;
+
+    if (isDir(old) != isDir(node)) {
+        errno = isDir(old) ? EISDIR : ENOTDIR;
+        return false;
+    }
+    if (isDir(old) && (!asDir(old) || !isEmpty(old))) {
+        errno = ENOTEMPTY;
+        return false;
+    }
     return true;
 }
 
+/// Removes `.` and `..` of the empty directory `node` with the references they hold, the entry linking it is up to the caller
+static void removeDirectory(inode* node) {
+    assert(node->nlink == 2); // . and itself
+    countReferences(removeEntry(asDir(node), ".."), -1, 0, 0);
+    assert(asDir(node)->first->next == NULL);
+    directory* dir = asDir(node);
+    node->data = NULL;
+    retireDirectory(dir);
+    refund(node->quota, directoryFootprint() + entryFootprint(1) + entryFootprint(2));
+    countReferences(node, -1, 0, 0);
+}
+
+/// Takes back `initDirectory` of `node` that was never linked, the references `.` and `..` hold too
+static void discardDirectory(inode* node) {
+    directory* dir = asDir(node);
+    node->data = NULL;
+    releaseDirectory(dir);
+    refund(node->quota, directoryFootprint() + entryFootprint(1) + entryFootprint(2));
+    writeLock(node);
+    node->nlink--;
+    unlock(node);
+    countReferences(node->parent, -1, 0, 0);
+}
+
 /// Finds parent directory for the file with `path`, sets `name` to point to the start of the filename in `path`
 static inode* getParentDirectory(const char* path, const char** name, inode* root) {
-    int n;
-    char dirPath[PATH_MAX];
     errorFree(checkPath(path));
-    errorFree(n = extractPrefix(dirPath, path));
-
-    inode* dirNode = pathfind(dirPath, root);
+    component file;
+    inode* dirNode = walkPath(path, root, &file);
     if (!dirNode) return NULL;
+    if (!file.length) {
+        fprintf(stderr, "filename for '%s' is empty", path);
+        errno = ENOENT;
+        return NULL;
+    }
 
     if (!isDir(dirNode)) {
         errno = ENOTDIR;
         return NULL;
     }
     
-    // "dirPath / [path + n + 1]: fileName \0"
-    if (name) *name = path + n + 1;
+    if (name) *name = file.name;
     return dirNode;
 }
+
+/// Paths with `.` or `..` components can go stale without being touched by a mutation, so they bypass the cache
+static bool isCacheable(const char* path) {
+    for (const char* p = path; (p = strchr(p, '.')); ++p) {
+        if (p != path && p[-1] != Split) continue;
+        if (p[1] == '.') ++p;
+        if (p[1] == Split || p[1] == '\0') return false;
+    }
+    return true;
+}
+
+/// Drops the cached lookup of exactly `path`, called whenever the name appears or disappears
+static void forgetPath(const char* path, Filesystem* fs) {
+    size_t n = strlen(path);
+    uint32_t hash = hashName(path, n);
+    _Atomic(dentry*)* slot = &fs->table[hash % NBuckets];
+
+    enterEpoch(); // the entry might be replaced and retired by a lookup meanwhile
+    dentry* d = *slot;
+    if (d && d->hash == hash && strcmp(d->path, path) == 0 && atomic_compare_exchange_strong(slot, &d, NULL))
+        retire(d, free);
+    exitEpoch();
+}
+
+/// Applies changes to the reference counters of `node` and retires it once none are left
+/// - Returns: `false` if the `node` was already dead, nothing is changed then
+static bool countReferences(inode* node, int links, int opens, int64_t lookups) {
+    writeLock(node);
+    if (node->dead) {
+        unlock(node);
+        errno = ENOENT;
+        return false;
+    }
+    node->nlink += links;
+    node->nopen += opens;
+    node->nlookup += lookups;
+    bool unreferenced = node->nlink <= 0 && !node->nopen && !node->nlookup;
+    node->dead = unreferenced;
+    unlock(node);
+
+    // the tree cannot reach it anymore, but lock free readers still might
+    if (unreferenced) retire(node, freeNodeObject);
+    return true;
+}
+
+static void freeNode(inode* node) {
+#ifdef PageCompression
+    packer* packer = node->packer;
+    if (packer) {
+        pthread_mutex_lock(&packer->lock);
+        while (packer->current == node) pthread_cond_wait(&packer->wake, &packer->lock);
+        if (node->prevFile) node->prevFile->nextFile = node->nextFile;
+        else packer->files = node->nextFile;
+        if (node->nextFile) node->nextFile->prevFile = node->prevFile;
+        pthread_mutex_unlock(&packer->lock);
+    }
+#endif
+    if (isDir(node) && node->data) releaseDirectory(node->data);
+    storageRelease(&node->file, node->quota);
+    pthread_rwlock_destroy(&node->lock);
+    unnumberNode(node);
+    refundInode(node->quota, InodeFootprint);
+    poolFree(&inodes, node);
+}
+
+static void freeNodeObject(void* node) {
+    freeNode(node);
+}
+
+/// Gives `node` the most recently freed number, or the next one never used, with the generation of that number
+/// - Returns: `false` once every number is taken
+static bool numberNode(inodeTable* numbers, inode* node) {
+    pthread_mutex_lock(&numbers->lock);
+    uint32_t ino = numbers->free;
+    numberSlot* slot;
+    if (ino) {
+        slot = &numbers->chunks[ino >> ChunkShift][ino & ChunkMask];
+        numbers->free = slot->nextFree;
+    } else {
+        ino = numbers->last + 1;
+        _Atomic(numberSlot*)* chunk = &numbers->chunks[ino >> ChunkShift];
+        if (ino > MaxIno || (!*chunk && !(*chunk = calloc(1 << ChunkShift, sizeof(numberSlot))))) {
+            pthread_mutex_unlock(&numbers->lock);
+            return false;
+        }
+        numbers->last = ino;
+        slot = &(*chunk)[ino & ChunkMask];
+    }
+    node->ino = ino;
+    node->generation = slot->generation;
+    node->numbers = numbers;
+    slot->node = node;
+    pthread_mutex_unlock(&numbers->lock);
+    return true;
+}
+
+/// Frees the number of `node` for the next inode, which gets the next generation of it
+static void unnumberNode(inode* node) {
+    inodeTable* numbers = node->numbers;
+    pthread_mutex_lock(&numbers->lock);
+    numberSlot* slot = &numbers->chunks[node->ino >> ChunkShift][node->ino & ChunkMask];
+    slot->node = NULL;
+    slot->generation++;
+    slot->nextFree = numbers->free;
+    numbers->free = (uint32_t)node->ino;
+    pthread_mutex_unlock(&numbers->lock);
+}
+
+/// Tells if `size` bytes at `offset` fit in a file, `EINVAL` for a negative `offset` and `EFBIG` past the largest `off_t`
+static bool checkRange(size_t size, off_t offset) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return false;
+    }
+    if (size > (size_t)(INT64_MAX - offset)) {
+        errno = EFBIG;
+        return false;
+    }
+    return true;
+}
+
+#ifdef PageCompression
+static int64_t seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/// Marks the file hot, called with the `node` locked either way
+static void touchNode(inode* node) {
+    atomic_store_explicit(&node->accessed, seconds(), memory_order_relaxed);
+}
+
+/// Goes over the files every half of the interval and packs those not accessed for all of it.
+/// Files in use are skipped rather than waited for
+static void* packLoop(void* arg) {
+    packer* packer = &((Filesystem*)arg)->packer;
+    pthread_mutex_lock(&packer->lock);
+    while (!packer->stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += packer->after / 2 + 1;
+        pthread_cond_timedwait(&packer->wake, &packer->lock, &until);
+
+        int64_t cold = seconds() - packer->after;
+        for (inode* node = packer->files; node && !packer->stopping; node = node->nextFile) {
+            if (atomic_load_explicit(&node->accessed, memory_order_relaxed) > cold) continue;
+
+            // `freeNode` waits for it, so the list can be followed from here once done
+            packer->current = node;
+            pthread_mutex_unlock(&packer->lock);
+            if (pthread_rwlock_trywrlock(&node->lock) == 0) {
+                if (!node->packed && atomic_load(&node->accessed) <= cold) {
+                    storagePack(&node->file, node->quota);
+                    node->packed = true;
+                }
+                unlock(node);
+            }
+            pthread_mutex_lock(&packer->lock);
+            packer->current = NULL;
+            pthread_cond_broadcast(&packer->wake);
+        }
+    }
+    pthread_mutex_unlock(&packer->lock);
+    return NULL;
+}
+#endif
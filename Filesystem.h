@@ -3,50 +3,179 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+#include "Directory.h"
+#include "Storage.h"
+#include "Epoch.h"
+#include "Quota.h"
 
 #define Split '/'
+#define NBuckets 16384
 
 #define isDir(node) S_ISDIR((node)->mode)
 #define isFile(node) S_ISREG((node)->mode)
+#define asDir(node) ((directory*)(node)->data)
+
+/// Both `Filesystem` and `inode` are guarded by their `lock`, the tree one is always taken first.
+/// Lookups and readdir skip the tree lock and run inside an epoch instead
+#define readLock(object) pthread_rwlock_rdlock(&(object)->lock)
+#define writeLock(object) pthread_rwlock_wrlock(&(object)->lock)
+#define unlock(object) pthread_rwlock_unlock(&(object)->lock)
 
 typedef uint32_t uint;
 
+struct packer;
+struct journal;
+struct inodeTable;
+
 typedef struct inode {
+    pthread_rwlock_t lock; /// guards the counters, attributes and file contents
     mode_t mode;
     uid_t uid;
     gid_t gid;
     int nlink;
     uint nopen;
-    uint size;
-    void* data;
+    uint64_t nlookup; /// references held by the kernel in the low-level API
+    uint64_t serial; /// never reused within a filesystem, saved in the image and told by the journal
+    uint64_t ino; /// index in the `inodeTable`, the root is `1`, reused once the inode is freed
+    uint32_t generation; /// of `ino`, so that the kernel tells apart inodes that had the same number
+    off_t size;
+    uint64_t version; /// bumped on every change of the contents
+    uint64_t cachedVersion; /// contents the kernel was told to cache at the last open
+    uint64_t dedupedVersion; /// contents at the last `dedupNode`, unchanged files are not hashed again
+    _Atomic(void*) data; /// `directory` of a directory, `NULL` before `initDirectory` and after removal
+    storage file; /// contents of a regular file
     struct inode* parent;
-    bool traversing; /// flag to avoid loops when releasing memory
+    bool dead; /// unreferenced and retired, epoch readers may still see it but must not pick it up
+    quota* quota; /// of the filesystem, charged for the inode, its pages and its entries
+    struct journal* journal; /// of the filesystem, `NULL` unless changes are journaled
+    struct inodeTable* numbers; /// of the filesystem, where `ino` leads back to the inode
+#ifdef PageCompression
+    _Atomic int64_t accessed; /// seconds of the monotonic clock, packed once cold
+    bool packed; /// nothing was written or unpacked since the last packing, so that it is not repeated
+    struct packer* packer; /// of the filesystem, for regular files
+    struct inode* prevFile;
+    struct inode* nextFile;
+#endif
 } inode;
 
-typedef struct entryTM { // apparently name `struct entry` is taken by some stupid search header
-    char name[NAME_MAX];
-    inode* node;
-    struct entryTM* next; /// for linked list
-} entry;
+#ifdef PageCompression
+/// Background thread compressing files not accessed for a while
+typedef struct packer {
+    pthread_mutex_t lock; /// guards the list, taken before any inode lock
+    pthread_cond_t wake; /// stop requests and files done
+    inode* files; /// every regular file, newest first
+    inode* current; /// being packed, `freeNode` waits for it
+    unsigned after; /// seconds without access before a file is packed, `0` if stopped
+    bool stopping;
+    pthread_t thread;
+} packer;
+#endif
+
+/// Inodes by number, in chunks that never move once allocated, so that lookups take no lock
+#define ChunkShift 16
+#define ChunkMask ((1u << ChunkShift) - 1)
+#define NChunks 4096
+#define MaxIno (((uint64_t)NChunks << ChunkShift) - 1)
 
+typedef struct numberSlot {
+    _Atomic(inode*) node; /// `NULL` while the number is free
+    uint32_t generation; /// bumped whenever the number is freed
+    uint32_t nextFree;
+} numberSlot;
+
+typedef struct inodeTable {
+    pthread_mutex_t lock; /// guards the free list and the allocation of chunks
+    _Atomic(numberSlot*) chunks[NChunks];
+    uint32_t last; /// highest number handed out so far
+    uint32_t free; /// most recently freed number, `0` if there is none
+} inodeTable;
+
+/// Cached result of a full path lookup, immutable once published
 typedef struct {
+    uint32_t hash;
+    uint32_t epoch;
+    inode* node; /// `NULL` if the lookup failed with `ENOENT`
+    char path[];
+} dentry;
+
+typedef struct {
+    pthread_rwlock_t lock; /// guards the tree: directories, their entries and `parent` links
     inode* root;
-//    inode* table[NBuckets];
+    _Atomic(dentry*) table[NBuckets]; /// direct mapped, colliding paths evict each other
+    _Atomic uint32_t epoch; /// bumped to drop the whole `table` at once
+    _Atomic uint64_t changes; /// bumped before and after writers touch the tree, lookups seeing it odd or moved do not cache
+    quota quota; /// memory and inodes in use, and the `size=` and `nr_inodes=` limits
+    bool dedup; /// files share identical pages once closed
+    void* image; /// mapping of the image the filesystem was loaded from, pages of files point into it
+    size_t imageLength;
+    _Atomic uint64_t serials; /// the last one given to an inode
+    uint64_t sequence; /// of the last journal record the image includes
+    struct journal* journal; /// where changes go, set once the journal is replayed
+    inodeTable numbers;
+#ifdef PageCompression
+    packer packer;
+#endif
 } Filesystem;
 
-entry* addEntry(entry* list, const char* name);
+inode* newNode(Filesystem* fs, mode_t mode, uid_t uid, gid_t gid);
+bool initDirectory(inode* node);
+
+inode* linkNode(inode* dirNode, const char* name, inode* node);
+inode* relinkNode(inode* dirNode, const char* name, inode* newDirNode, const char* newName);
+bool unlinkNode(inode* dirNode, const char* name);
+
+bool openNode(inode* node);
+void closeNode(inode* node);
+bool pinNode(inode* node);
+void forgetNode(inode* node, uint64_t nlookup);
+void dropNode(inode* node);
 
-inode* addNode(const char* path, inode* root, inode* node);
-inode* moveNode(const char* path, const char* newpath, inode* root);
+bool lockRange(inode* node, size_t size, off_t offset);
+void statNode(inode* node, struct stat* statbuf);
+ssize_t readNode(inode* node, char* buf, size_t size, off_t offset);
+size_t mapNode(inode* node, struct iovec* vec, size_t size, off_t offset);
+ssize_t writeNode(inode* node, const char* buf, size_t size, off_t offset);
+ssize_t reserveNode(inode* node, struct iovec* vec, size_t size, off_t offset);
+void commitNode(inode* node, size_t size, size_t written, off_t offset);
+bool truncateNode(inode* node, off_t offset);
+off_t seekNode(inode* node, off_t offset, int whence);
+bool keepCache(inode* node);
+void dedupNode(inode* node);
+bool cloneNode(inode* node, inode* from);
+ssize_t copyNode(inode* node, off_t offset, inode* from, off_t fromOffset, size_t size);
+bool allocateNode(inode* node, int mode, off_t offset, off_t length);
+void lockPair(inode* a, inode* b);
+void unlockPair(inode* a, inode* b);
+
+inode* addNode(const char* path, Filesystem* fs, inode* node);
+inode* moveNode(const char* path, const char* newpath, Filesystem* fs);
+inode* lookupNode(const char* path, Filesystem* fs);
 inode* pathfind(const char* path, inode* root);
+inode* numberedNode(Filesystem* fs, uint64_t ino);
+
+bool releaseNode(const char* path, Filesystem* fs);
+
+Filesystem* newFilesystem(size_t maxBytes, size_t maxInodes);
+void statFilesystem(Filesystem* fs, struct statvfs* st);
 
-bool releaseNode(const char* path, inode* root);
+#ifdef PageCompression
+/// Read only extended attribute with what packing of the file achieved
+#define PackingAttribute "user.ramfs.compression"
 
-Filesystem* newFilesystem(void);
+bool startPacker(Filesystem* fs, unsigned after);
+void stopPacker(Filesystem* fs);
+ssize_t packingAttribute(inode* node, char* buf, size_t size);
+#endif
 
-void releaseAll(inode* root);
+void releaseAll(Filesystem* fs);
+void releaseFilesystem(Filesystem* fs);
 
 
 #endif /* inode_h */
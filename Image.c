@@ -0,0 +1,518 @@
+#include "Image.h"
+#include "Journal.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ImageMagic "RAMFSIMG"
+#define ImageVersion 2
+/// Pages at least this large have their bytes start at a page of the memory, so faulting one in reads only it
+#define AlignedCapacity 4096
+#define TableAlign 8
+
+/// At the start of the image, all offsets are from there
+typedef struct imageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pageShift; /// of the build that saved it, pages are only mapped by a matching one
+    uint32_t pageHeader; /// `sizeof(page)`, the layout of the stored pages
+    uint32_t reserved;
+    uint64_t root; /// index in the inode table
+    uint64_t nodes, nodeTable; /// number of records and where the table starts
+    uint64_t entries, entryTable;
+    uint64_t pages, pageTable;
+    uint64_t sequence; /// of the last journal record included, replay goes on from the next one
+} imageHeader;
+
+typedef struct imageNode {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t reserved;
+    int64_t size;
+    uint64_t firstEntry, entries; /// of a directory, without `.` and `..`
+    uint64_t firstPage, pages; /// of a regular file, in the order of the file
+    uint64_t serial;
+} imageNode;
+
+typedef struct imageEntry {
+    uint64_t node; /// index in the inode table
+    uint64_t name; /// offset of the zero terminated name
+} imageEntry;
+
+typedef struct imagePage {
+    uint64_t index; /// in the file
+    uint64_t offset; /// of the `page` with `PinnedRefs`
+} imagePage;
+
+/// What `saveImage` collected so far, the tables go to the file after the pages and the names
+typedef struct writer {
+    FILE* file;
+    uint64_t at; /// bytes written
+    inode** nodes; /// by address, so that entries find their index with a binary search
+    size_t nodeCount;
+    size_t pinned; /// leading `nodes` kept alive with an open handle until the pages are written
+    size_t root; /// index of the root in `nodes`
+    imageNode* records;
+    imageEntry* entries; /// names are offsets in `names` until they are written
+    size_t entryCount, entryCapacity;
+    char* names;
+    size_t namesLength, namesCapacity;
+    imagePage* pages;
+    size_t pageCount, pageCapacity;
+} writer;
+
+static struct {
+    Filesystem* fs;
+    const char* path;
+    bool running;
+    atomic_bool stopping;
+    pthread_t thread;
+} saver;
+
+static bool collectTree(writer* w, Filesystem* fs);
+static bool collectNodes(writer* w, inode* root);
+static bool collectDirectory(writer* w, inode* node, imageNode* record);
+static bool writeImage(writer* w, uint64_t sequence);
+static bool writeFile(writer* w, inode* node, imageNode* record, char* scratch);
+static bool put(writer* w, const void* data, size_t size);
+static bool padTo(writer* w, uint64_t offset);
+static bool reserve(void** array, size_t* capacity, size_t count, size_t size);
+static int compareNodes(const void* a, const void* b);
+static size_t indexOf(writer* w, inode* node);
+static bool checkTable(uint64_t offset, uint64_t count, size_t size, size_t length);
+static bool readImage(Filesystem* fs, const char* base, size_t length);
+static bool readFile(inode* node, const imageNode* record, const char* base, size_t length);
+static bool readDirectories(inode** nodes, const char* base, size_t length);
+static void* saveLoop(void* arg);
+
+/// Writes the whole tree of `fs` to `path`, replacing it at once when done. Tree changes only wait while the
+/// inodes and entries are collected, writes to files only while the pages of that file are saved
+/// - Returns: `false` on error, `path` is left as it was then
+bool saveImage(Filesystem* fs, const char* path) {
+    journal* j = fs->journal;
+    char temporary[PATH_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int)sizeof(temporary)) {
+        if (j) journalCheckpointFailed(j);
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    writer w = { .file = fopen(temporary, "wb") };
+    if (!w.file) {
+        int err = errno;
+        if (j) journalCheckpointFailed(j);
+        errno = err;
+        return false;
+    }
+
+    // writes to files go on meanwhile, the journal past `sequence` redoes them over what got saved
+    readLock(fs);
+    uint64_t sequence = j ? journalRotate(j) : fs->sequence;
+    bool ok = collectTree(&w, fs);
+    unlock(fs);
+
+    ok = ok && writeImage(&w, sequence);
+    int err = errno;
+    for (size_t i = 0; i < w.pinned; ++i)
+        closeNode(w.nodes[i]); // the ones unlinked meanwhile go here
+    free(w.nodes);
+    free(w.records);
+    free(w.entries);
+    free(w.names);
+    free(w.pages);
+    errno = err;
+
+    // on the disk before it replaces the old image
+    ok = ok && fflush(w.file) == 0 && fsync(fileno(w.file)) == 0;
+    err = errno;
+    if (fclose(w.file) != 0 && ok) {
+        ok = false;
+        err = errno;
+    }
+    if (ok && rename(temporary, path) == 0) {
+        if (j) journalCheckpointed(j);
+        return true;
+    }
+    if (ok) err = errno;
+
+    unlink(temporary);
+    if (j) journalCheckpointFailed(j);
+    errno = err;
+    return false;
+}
+
+/// Maps the image at `path` and builds a filesystem of it with the limits given, the file pages stay in the
+/// mapping until written, and are not charged to the filesystem while they are there
+/// - Returns: `NULL` on error, `EINVAL` if it is not an image of this build or it is damaged
+Filesystem* loadImage(const char* path, size_t maxBytes, size_t maxInodes) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t length = (size_t)st.st_size;
+    if (length < sizeof(imageHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    // private and read only, so that nothing done here reaches the file
+    char* base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    Filesystem* fs = newFilesystem(maxBytes, maxInodes);
+    fs->image = base;
+    fs->imageLength = length;
+    if (!readImage(fs, base, length)) {
+        int err = errno;
+        releaseFilesystem(fs); // unmaps the image after the last page is dropped
+        errno = err;
+        return NULL;
+    }
+    return fs;
+}
+
+/// Leaves `SaveSignal` to the saver, has to be called before any thread is started
+void blockSaveSignal(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SaveSignal);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/// Saves `fs` to `path` on every `SaveSignal`, and once more at `stopSaver`
+/// - Returns: `false` if the thread could not be started, the image is only saved at `stopSaver` then
+bool startSaver(Filesystem* fs, const char* path) {
+    saver.fs = fs;
+    saver.path = path;
+    atomic_store(&saver.stopping, false);
+    saver.running = pthread_create(&saver.thread, NULL, saveLoop, NULL) == 0;
+    return saver.running;
+}
+
+/// Stops the thread and saves the image a last time, before the filesystem goes away
+void stopSaver(void) {
+    if (saver.running) {
+        atomic_store(&saver.stopping, true);
+        pthread_kill(saver.thread, SaveSignal);
+        pthread_join(saver.thread, NULL);
+        saver.running = false;
+    }
+    if (!saver.fs) return;
+    if (saveImage(saver.fs, saver.path)) fprintf(stderr, "Saved the image to %s\n", saver.path);
+    else fprintf(stderr, "Warning: could not save the image to %s: %s\n", saver.path, strerror(errno));
+    saver.fs = NULL;
+}
+
+/// Takes the inode and entry tables of the tree, with the tree locked, and keeps every inode alive
+/// until its pages are written
+static bool collectTree(writer* w, Filesystem* fs) {
+    if (!collectNodes(w, fs->root)) return false;
+    w->records = calloc(w->nodeCount, sizeof(imageNode));
+    if (!w->records) {
+        errno = ENOMEM;
+        return false;
+    }
+    for (size_t i = 0; i < w->nodeCount; ++i) {
+        inode* node = w->nodes[i];
+        openNode(node); // linked, so it cannot be dead yet
+        w->pinned++;
+        w->records[i] = (imageNode){ .mode = node->mode, .uid = node->uid, .gid = node->gid, .serial = node->serial };
+        if (isDir(node) && !collectDirectory(w, node, &w->records[i])) return false;
+    }
+    w->root = indexOf(w, fs->root);
+    return true;
+}
+
+/// Lists every inode reachable from `root` once, breadth first so that deep trees take no stack
+static bool collectNodes(writer* w, inode* root) {
+    size_t capacity = 0;
+    if (!reserve((void**)&w->nodes, &capacity, 1, sizeof(inode*))) return false;
+    w->nodes[w->nodeCount++] = root;
+
+    // hard links show up more than once, they are merged after sorting
+    for (size_t i = 0; i < w->nodeCount; ++i) {
+        inode* node = w->nodes[i];
+        if (!isDir(node) || !asDir(node)) continue;
+        for (entry* p = asDir(node)->first->next->next; p; p = p->next) {
+            if (!reserve((void**)&w->nodes, &capacity, w->nodeCount + 1, sizeof(inode*))) return false;
+            w->nodes[w->nodeCount++] = p->node;
+        }
+    }
+
+    qsort(w->nodes, w->nodeCount, sizeof(inode*), compareNodes);
+    size_t unique = 0;
+    for (size_t i = 0; i < w->nodeCount; ++i)
+        if (!unique || w->nodes[unique - 1] != w->nodes[i]) w->nodes[unique++] = w->nodes[i];
+    w->nodeCount = unique;
+    return true;
+}
+
+/// Lists the entries of a directory, with their names copied aside
+static bool collectDirectory(writer* w, inode* node, imageNode* record) {
+    record->firstEntry = w->entryCount;
+    if (!asDir(node)) return true;
+    for (entry* p = asDir(node)->first->next->next; p; p = p->next) {
+        size_t n = strlen(p->name) + 1;
+        if (!reserve((void**)&w->entries, &w->entryCapacity, w->entryCount + 1, sizeof(imageEntry)) ||
+            !reserve((void**)&w->names, &w->namesCapacity, w->namesLength + n, 1)) return false;
+        w->entries[w->entryCount++] = (imageEntry){ indexOf(w, p->node), w->namesLength };
+        memcpy(w->names + w->namesLength, p->name, n);
+        w->namesLength += n;
+    }
+    record->entries = w->entryCount - record->firstEntry;
+    return true;
+}
+
+/// Writes the pages of every file, then the names and the tables, without the tree lock
+static bool writeImage(writer* w, uint64_t sequence) {
+    imageHeader header = { .magic = ImageMagic, .version = ImageVersion, .pageShift = PageShift,
+                           .pageHeader = sizeof(page), .sequence = sequence };
+    if (!put(w, &header, sizeof(header))) return false;
+
+    char* scratch = malloc(PageSize);
+    if (!scratch) return false;
+    bool ok = true;
+    for (size_t i = 0; ok && i < w->nodeCount; ++i)
+        if (isFile(w->nodes[i])) ok = writeFile(w, w->nodes[i], &w->records[i], scratch);
+    free(scratch);
+    if (!ok) return false;
+
+    uint64_t names = w->at;
+    if (!put(w, w->names, w->namesLength)) return false;
+    for (size_t i = 0; i < w->entryCount; ++i)
+        w->entries[i].name += names;
+
+    header.root = w->root;
+    header.nodes = w->nodeCount;
+    header.entries = w->entryCount;
+    header.pages = w->pageCount;
+    ok = padTo(w, (w->at + TableAlign - 1) & ~(uint64_t)(TableAlign - 1));
+    header.nodeTable = w->at;
+    ok = ok && put(w, w->records, w->nodeCount * sizeof(imageNode));
+    header.entryTable = w->at;
+    ok = ok && put(w, w->entries, w->entryCount * sizeof(imageEntry));
+    header.pageTable = w->at;
+    ok = ok && put(w, w->pages, w->pageCount * sizeof(imagePage));
+    if (!ok) return false;
+
+    if (fseek(w->file, 0, SEEK_SET) != 0) return false;
+    return fwrite(&header, sizeof(header), 1, w->file) == 1;
+}
+
+/// Writes the pages of `node` as they are in memory, with `PinnedRefs`, locking it meanwhile.
+/// Pages preallocated past the end are left out
+static bool writeFile(writer* w, inode* node, imageNode* record, char* scratch) {
+    readLock(node);
+    record->size = node->size;
+    record->firstPage = w->pageCount;
+
+    bool ok = true;
+    size_t capacity, index = 0, end = ((size_t)node->size + PageSize - 1) >> PageShift;
+    for (const char* bytes; ok && (bytes = storageNext(&node->file, &index, &capacity, scratch)) && index < end; ++index) {
+        uint64_t at = capacity >= AlignedCapacity
+            ? ((w->at + sizeof(page) + AlignedCapacity - 1) & ~(uint64_t)(AlignedCapacity - 1)) - sizeof(page)
+            : (w->at + _Alignof(page) - 1) & ~(uint64_t)(_Alignof(page) - 1);
+        page header = { .capacity = (uint32_t)capacity, .entry = NULL };
+        atomic_init(&header.refs, PinnedRefs);
+
+        ok = reserve((void**)&w->pages, &w->pageCapacity, w->pageCount + 1, sizeof(imagePage)) &&
+             padTo(w, at) && put(w, &header, sizeof(page)) && put(w, bytes, capacity);
+        if (ok) w->pages[w->pageCount++] = (imagePage){ index, at };
+    }
+    record->pages = w->pageCount - record->firstPage;
+    unlock(node);
+    return ok;
+}
+
+static bool put(writer* w, const void* data, size_t size) {
+    if (size && fwrite(data, size, 1, w->file) != 1) return false;
+    w->at += size;
+    return true;
+}
+
+/// Writes zeros up to `offset`
+static bool padTo(writer* w, uint64_t offset) {
+    static const char zeros[AlignedCapacity];
+    while (w->at < offset) {
+        size_t n = offset - w->at < sizeof(zeros) ? (size_t)(offset - w->at) : sizeof(zeros);
+        if (!put(w, zeros, n)) return false;
+    }
+    return true;
+}
+
+/// Grows `array` of `size` byte items to fit `count` of them, doubling
+static bool reserve(void** array, size_t* capacity, size_t count, size_t size) {
+    if (count <= *capacity) return true;
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    while (grown < count) grown *= 2;
+    void* p = realloc(*array, grown * size);
+    if (!p) return false;
+    *array = p;
+    *capacity = grown;
+    return true;
+}
+
+static int compareNodes(const void* a, const void* b) {
+    const inode* x = *(inode* const*)a;
+    const inode* y = *(inode* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t indexOf(writer* w, inode* node) {
+    inode** found = bsearch(&node, w->nodes, w->nodeCount, sizeof(inode*), compareNodes);
+    return (size_t)(found - w->nodes);
+}
+
+/// Tells if `count` records of `size` bytes at `offset` are inside an image of `length` bytes, and aligned
+static bool checkTable(uint64_t offset, uint64_t count, size_t size, size_t length) {
+    return offset % TableAlign == 0 && offset <= length && count <= (length - offset) / size;
+}
+
+/// Builds the tree out of the tables, every inode is checked before it is used
+static bool readImage(Filesystem* fs, const char* base, size_t length) {
+    const imageHeader* h = (const imageHeader*)base;
+    if (memcmp(h->magic, ImageMagic, sizeof(h->magic)) != 0 || h->version != ImageVersion ||
+        h->pageShift != PageShift || h->pageHeader != sizeof(page) || h->root >= h->nodes ||
+        !checkTable(h->nodeTable, h->nodes, sizeof(imageNode), length) ||
+        !checkTable(h->entryTable, h->entries, sizeof(imageEntry), length) ||
+        !checkTable(h->pageTable, h->pages, sizeof(imagePage), length)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    const imageNode* records = (const imageNode*)(base + h->nodeTable);
+    inode** nodes = calloc(h->nodes, sizeof(inode*));
+    if (!nodes) return false;
+
+    bool ok = S_ISDIR(records[h->root].mode);
+    if (!ok) errno = EINVAL;
+    for (size_t i = 0; ok && i < h->nodes; ++i) {
+        const imageNode* r = &records[i];
+        if (!r->serial) {
+            errno = EINVAL;
+            ok = false;
+            break;
+        }
+        inode* node = i == h->root ? fs->root : newNode(fs, r->mode, r->uid, r->gid);
+        if (!node) {
+            ok = false;
+            break;
+        }
+        nodes[i] = node;
+        node->mode = r->mode;
+        node->uid = r->uid;
+        node->gid = r->gid;
+        node->serial = r->serial;
+        if (r->serial > fs->serials) fs->serials = r->serial;
+        if (isFile(node)) {
+            ok = readFile(node, r, base, length);
+        } else if (r->pages || (!isDir(node) && r->entries)) {
+            errno = EINVAL;
+            ok = false;
+        }
+    }
+    if (ok) ok = readDirectories(nodes, base, length);
+    fs->sequence = h->sequence;
+
+    // whatever nothing links to goes away, on error too
+    int err = errno;
+    for (size_t i = 0; i < h->nodes && nodes[i]; ++i)
+        if (i != h->root) dropNode(nodes[i]);
+    free(nodes);
+    errno = err;
+    return ok;
+}
+
+/// Points the pages of the file at the image, each one has to be a pinned page that fits in the image and the file
+static bool readFile(inode* node, const imageNode* record, const char* base, size_t length) {
+    const imageHeader* h = (const imageHeader*)base;
+    if (record->size < 0 || record->firstPage > h->pages || record->pages > h->pages - record->firstPage) {
+        errno = EINVAL;
+        return false;
+    }
+    node->size = record->size;
+
+    const imagePage* pages = (const imagePage*)(base + h->pageTable) + record->firstPage;
+    size_t end = ((size_t)node->size + PageSize - 1) >> PageShift;
+    for (size_t i = 0; i < record->pages; ++i) {
+        uint64_t offset = pages[i].offset;
+        page* p = offset <= length - sizeof(page) ? (page*)(base + offset) : NULL;
+        if (!p || offset % _Alignof(page) || pages[i].index >= end ||
+            (i && pages[i].index <= pages[i - 1].index) || atomic_load(&p->refs) != PinnedRefs || p->entry ||
+            p->capacity < MinPageCapacity || p->capacity > PageSize || (p->capacity & (p->capacity - 1)) ||
+            p->capacity > length - offset - sizeof(page)) {
+            errno = EINVAL;
+            return false;
+        }
+        if (!storageAdopt(&node->file, node->quota, (size_t)pages[i].index, p)) return false;
+    }
+    return true;
+}
+
+/// Links the entries of every directory reachable from the root, each directory only once
+static bool readDirectories(inode** nodes, const char* base, size_t length) {
+    const imageHeader* h = (const imageHeader*)base;
+    const imageNode* records = (const imageNode*)(base + h->nodeTable);
+    const imageEntry* entries = (const imageEntry*)(base + h->entryTable);
+
+    // breadth first, the queue holds indices of directories already linked
+    size_t* queue = malloc(h->nodes * sizeof(size_t));
+    if (!queue) return false;
+    size_t count = 0;
+    queue[count++] = h->root;
+
+    bool ok = true;
+    for (size_t k = 0; ok && k < count; ++k) {
+        const imageNode* r = &records[queue[k]];
+        inode* dirNode = nodes[queue[k]];
+        if (r->firstEntry > h->entries || r->entries > h->entries - r->firstEntry) {
+            errno = EINVAL;
+            ok = false;
+        }
+        for (size_t i = 0; ok && i < r->entries; ++i) {
+            const imageEntry* e = &entries[r->firstEntry + i];
+            size_t room = e->name < length ? length - e->name : 0;
+            const char* name = room ? base + e->name : NULL;
+            ok = e->node < h->nodes && room && memchr(name, '\0', room < NAME_MAX + 1 ? room : NAME_MAX + 1) &&
+                 *name && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && !strchr(name, Split);
+            inode* node = ok ? nodes[e->node] : NULL;
+            // a directory linked twice would make a loop
+            if (ok && isDir(node) && (node->parent || e->node == h->root)) ok = false;
+            if (!ok) {
+                errno = EINVAL;
+                break;
+            }
+
+            ok = linkNode(dirNode, name, node) != NULL;
+            if (ok && isDir(node)) queue[count++] = (size_t)e->node;
+        }
+    }
+    free(queue);
+    return ok;
+}
+
+static void* saveLoop(void* arg) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SaveSignal);
+    for (;;) {
+        int signal;
+        if (sigwait(&set, &signal) != 0) continue;
+        if (atomic_load(&saver.stopping)) break;
+        if (saveImage(saver.fs, saver.path)) fprintf(stderr, "Saved the image to %s\n", saver.path);
+        else fprintf(stderr, "Warning: could not save the image to %s: %s\n", saver.path, strerror(errno));
+    }
+    return NULL;
+}
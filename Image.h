@@ -0,0 +1,24 @@
+#ifndef image_h
+#define image_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+
+#include "Filesystem.h"
+
+/// Snapshots of the whole tree in a file: the pages first, laid out the way `storage` keeps them, followed by
+/// tables of the inodes, the directory entries and the pages of every file. Loading maps the file and points
+/// the files at the pages there, so they are only read from the disk when first accessed
+
+/// Makes a running filesystem save its image
+#define SaveSignal SIGUSR1
+
+bool saveImage(Filesystem* fs, const char* path);
+Filesystem* loadImage(const char* path, size_t maxBytes, size_t maxInodes);
+
+void blockSaveSignal(void);
+bool startSaver(Filesystem* fs, const char* path);
+void stopSaver(void);
+
+#endif /* image_h */
@@ -0,0 +1,736 @@
+#include "Journal.h"
+#include "Image.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define JournalMagic "RAMFSJNL"
+#define JournalVersion 1
+#define BatchMagic 0x4254414au
+/// Request threads wait for the writer once this much is queued
+#define MaxQueued ((size_t)64 << 20)
+/// Data of larger writes is split over several records, so that none has to be queued at once
+#define MaxRecordData ((size_t)1 << 20)
+/// Written to the current file before the writer asks the saver for an image, so that replay stays short
+#define CheckpointBytes ((uint64_t)256 << 20)
+
+enum { RecordLink = 1, RecordUnlink, RecordRename, RecordAttributes, RecordTruncate, RecordWrite, RecordAllocate };
+
+typedef struct journalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} journalHeader;
+
+/// Records written at once, a torn batch at the end of the file is dropped at replay
+typedef struct batch {
+    uint32_t magic;
+    uint32_t checksum; /// of the records
+    uint64_t length; /// bytes of the records that follow
+} batch;
+
+/// One change, followed by `length` bytes of names or data. Inodes are told by their `serial`
+typedef struct record {
+    uint32_t type;
+    uint32_t mode; /// of the linked inode, the new one of `RecordAttributes`, or the `fallocate` mode
+    uint32_t uid, gid;
+    uint64_t sequence;
+    uint64_t node; /// the directory for changes of entries
+    uint64_t other; /// the linked inode, or the new directory of a rename
+    int64_t offset;
+    int64_t size; /// truncated to or allocated
+    uint64_t length; /// a name, two zero separated ones for a rename, or the written bytes
+} record;
+
+struct journal {
+    pthread_mutex_t lock; /// guards everything below but the file, taken after any tree or inode lock
+    pthread_cond_t wake; /// records queued, a rotation asked for or stopping, for the writer
+    pthread_cond_t done; /// the writer took the queue, synced it or finished a rotation
+    Filesystem* fs;
+    char* queue; /// records the writer has not taken yet
+    size_t length, capacity;
+    uint64_t sequence; /// of the last record queued
+    uint64_t synced; /// last record on the disk, request threads wait for it when `interval` is `0`
+    size_t rotateAt; /// bytes of the queue that still go to the current file, `SIZE_MAX` unless rotating
+    bool old; /// `PATH.old` is there and no image covers it yet
+    bool checkpointing; /// the saver was asked for an image
+    bool failed; /// the file could not be written, records are dropped from then on
+    bool running, stopping;
+    unsigned interval; /// milliseconds between syncs
+    char* scratch; /// for packed pages, `journalWritten` runs under the write lock of the file
+    int fd;
+    char* path;
+    pthread_t thread;
+};
+
+/// Inodes by serial while replaying, every one of them is open so that none goes away meanwhile
+typedef struct replayer {
+    journal* j;
+    inode** slots; /// open addressing, the capacity is a power of two
+    size_t capacity, count;
+    size_t applied, skipped;
+} replayer;
+
+static char* queueRecord(journal* j, record* r, size_t length);
+static void queued(journal* j, uint64_t sequence);
+static void queueData(inode* node, const char* buf, size_t size, off_t offset, bool exported);
+static void* writeLoop(void* arg);
+static bool appendBatch(journal* j, const char* records, size_t length);
+static bool rotateFile(journal* j);
+static int openFile(const char* path);
+static bool oldPath(const journal* j, char* result);
+static uint32_t checksum(const char* bytes, size_t length);
+static bool replayFile(replayer* r, const char* path, bool cut);
+static void applyRecord(replayer* r, const record* rec, const char* data);
+static bool collectSerials(replayer* r, inode* root);
+static inode* findSerial(replayer* r, uint64_t serial);
+static bool addSerial(replayer* r, inode* node);
+static bool copyName(char* result, const char* data, size_t length);
+
+/// Replays `PATH.old` and `PATH` over `fs` past its `sequence`, cutting off a torn end, and opens `PATH` for appending.
+/// Changes to `fs` are journaled from then on, but only written after `startJournal`
+/// - Returns: `NULL` on error, `EINVAL` if a file is not a journal
+journal* openJournal(Filesystem* fs, const char* path, unsigned interval) {
+    journal* j = calloc(1, sizeof(journal));
+    if (!j) return NULL;
+    j->path = strdup(path);
+    j->scratch = malloc(PageSize);
+    char old[PATH_MAX];
+    if (!j->path || !j->scratch || !oldPath(j, old)) {
+        int err = j->path && j->scratch ? ENAMETOOLONG : ENOMEM;
+        free(j->path);
+        free(j->scratch);
+        free(j);
+        errno = err;
+        return NULL;
+    }
+    j->fs = fs;
+    j->interval = interval;
+    j->rotateAt = SIZE_MAX;
+    j->sequence = j->synced = fs->sequence;
+    j->fd = -1;
+
+    replayer r = { .j = j };
+    writeLock(fs);
+    bool ok = collectSerials(&r, fs->root) && replayFile(&r, old, false) && replayFile(&r, path, true) &&
+              (j->fd = openFile(path)) >= 0;
+    int err = errno;
+    for (size_t i = 0; i < r.capacity; ++i) {
+        inode* node = r.slots[i];
+        if (!node) continue;
+        if (ok) node->journal = j;
+        closeNode(node); // whatever got unlinked goes now
+    }
+    free(r.slots);
+    if (ok) fs->journal = j;
+    unlock(fs);
+
+    if (!ok) {
+        free(j->path);
+        free(j->scratch);
+        free(j);
+        errno = err;
+        return NULL;
+    }
+    j->old = access(old, F_OK) == 0;
+    if (r.applied || r.skipped)
+        fprintf(stderr, "Replayed %zu changes from %s, skipped %zu that no longer apply\n", r.applied, path, r.skipped);
+
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&j->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&j->done, NULL);
+    return j;
+}
+
+/// Starts the writer
+/// - Returns: `false` if the thread could not be started, records are only written at `closeJournal` then
+bool startJournal(journal* j) {
+    j->running = pthread_create(&j->thread, NULL, writeLoop, j) == 0;
+    return j->running;
+}
+
+/// Writes and syncs whatever is queued and closes the file, nothing may change the filesystem anymore
+void closeJournal(journal* j) {
+    if (j->running) {
+        pthread_mutex_lock(&j->lock);
+        j->stopping = true;
+        pthread_cond_signal(&j->wake);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->thread, NULL);
+    } else if (!j->failed && (!appendBatch(j, j->queue, j->length) || fdatasync(j->fd) != 0)) {
+        fprintf(stderr, "Warning: could not write the journal %s: %s\n", j->path, strerror(errno));
+    }
+    j->fs->journal = NULL;
+    close(j->fd);
+    pthread_cond_destroy(&j->wake);
+    pthread_cond_destroy(&j->done);
+    pthread_mutex_destroy(&j->lock);
+    free(j->queue);
+    free(j->scratch);
+    free(j->path);
+    free(j);
+}
+
+/// Starts a new file for the records queued from now on, called by `saveImage` with the tree locked.
+/// An old file no image covered yet is kept instead, the next image covers both
+/// - Returns: sequence of the last record the image has to include
+uint64_t journalRotate(journal* j) {
+    pthread_mutex_lock(&j->lock);
+    uint64_t sequence = j->sequence;
+    if (j->running && !j->old && !j->failed && j->rotateAt == SIZE_MAX) {
+        j->rotateAt = j->length;
+        pthread_cond_signal(&j->wake);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return sequence;
+}
+
+/// Drops the old file once the image saved after `journalRotate` is safely there
+void journalCheckpointed(journal* j) {
+    pthread_mutex_lock(&j->lock);
+    while (j->rotateAt != SIZE_MAX) pthread_cond_wait(&j->done, &j->lock);
+    char old[PATH_MAX];
+    if (j->old && oldPath(j, old) && (unlink(old) == 0 || errno == ENOENT)) j->old = false;
+    j->checkpointing = false;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/// The image could not be saved, the next `CheckpointBytes` of records ask for one again
+void journalCheckpointFailed(journal* j) {
+    pthread_mutex_lock(&j->lock);
+    j->checkpointing = false;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/// `node` got linked to `dirNode` under `name`, with the tree locked
+void journalLink(inode* dirNode, const char* name, inode* node) {
+    journal* j = dirNode->journal;
+    if (!j) return;
+    size_t n = strlen(name);
+    record r = { .type = RecordLink, .node = dirNode->serial, .other = node->serial,
+                 .mode = node->mode, .uid = node->uid, .gid = node->gid };
+    char* at = queueRecord(j, &r, n);
+    if (!at) return;
+    memcpy(at, name, n);
+    queued(j, r.sequence);
+}
+
+void journalUnlink(inode* dirNode, const char* name) {
+    journal* j = dirNode->journal;
+    if (!j) return;
+    size_t n = strlen(name);
+    record r = { .type = RecordUnlink, .node = dirNode->serial };
+    char* at = queueRecord(j, &r, n);
+    if (!at) return;
+    memcpy(at, name, n);
+    queued(j, r.sequence);
+}
+
+void journalRename(inode* dirNode, const char* name, inode* newDirNode, const char* newName) {
+    journal* j = dirNode->journal;
+    if (!j) return;
+    size_t n = strlen(name), m = strlen(newName);
+    record r = { .type = RecordRename, .node = dirNode->serial, .other = newDirNode->serial };
+    char* at = queueRecord(j, &r, n + 1 + m);
+    if (!at) return;
+    memcpy(at, name, n + 1);
+    memcpy(at + n + 1, newName, m);
+    queued(j, r.sequence);
+}
+
+/// Mode or owners of `node` changed, with it locked
+void journalAttributes(inode* node) {
+    journal* j = node->journal;
+    if (!j) return;
+    record r = { .type = RecordAttributes, .node = node->serial, .mode = node->mode, .uid = node->uid, .gid = node->gid };
+    if (queueRecord(j, &r, 0)) queued(j, r.sequence);
+}
+
+/// The file got its current size by a truncation, with it locked
+void journalTruncate(inode* node) {
+    journal* j = node->journal;
+    if (!j) return;
+    record r = { .type = RecordTruncate, .node = node->serial, .size = node->size };
+    if (queueRecord(j, &r, 0)) queued(j, r.sequence);
+}
+
+/// `size` bytes of `buf` got written at `offset`, with the file locked
+void journalWrite(inode* node, const char* buf, size_t size, off_t offset) {
+    queueData(node, buf, size, offset, false);
+}
+
+/// Same as `journalWrite`, but the bytes are taken from the file, after writes in place and copies
+void journalWritten(inode* node, size_t size, off_t offset) {
+    queueData(node, NULL, size, offset, true);
+}
+
+void journalAllocate(inode* node, int mode, off_t offset, off_t length) {
+    journal* j = node->journal;
+    if (!j) return;
+    record r = { .type = RecordAllocate, .node = node->serial, .mode = (uint32_t)mode, .offset = offset, .size = length };
+    if (queueRecord(j, &r, 0)) queued(j, r.sequence);
+}
+
+/// Appends `r` with `length` bytes to follow to the queue, waiting for the writer first if too much is queued already
+/// - Returns: where the `length` bytes go, with the journal locked until `queued`, `NULL` if the record is dropped
+static char* queueRecord(journal* j, record* r, size_t length) {
+    pthread_mutex_lock(&j->lock);
+    while (j->running && j->length && !j->failed && j->length + sizeof(record) + length > MaxQueued)
+        pthread_cond_wait(&j->done, &j->lock);
+    if (j->failed) {
+        pthread_mutex_unlock(&j->lock);
+        return NULL;
+    }
+
+    size_t need = j->length + sizeof(record) + length;
+    if (need > j->capacity) {
+        size_t capacity = j->capacity ? j->capacity : 64 * 1024;
+        while (capacity < need) capacity *= 2;
+        char* grown = realloc(j->queue, capacity);
+        if (!grown) {
+            fprintf(stderr, "Warning: out of memory for the journal, changes are not journaled anymore\n");
+            j->failed = true;
+            pthread_cond_broadcast(&j->done);
+            pthread_mutex_unlock(&j->lock);
+            return NULL;
+        }
+        j->queue = grown;
+        j->capacity = capacity;
+    }
+
+    r->sequence = ++j->sequence;
+    r->length = length;
+    memcpy(j->queue + j->length, r, sizeof(record));
+    char* at = j->queue + j->length + sizeof(record);
+    j->length = need;
+    return at;
+}
+
+/// Hands the record over to the writer, and waits until it is synced if every change has to be on the disk
+static void queued(journal* j, uint64_t sequence) {
+    pthread_cond_signal(&j->wake);
+    if (!j->interval)
+        while (j->running && !j->failed && j->synced < sequence) pthread_cond_wait(&j->done, &j->lock);
+    pthread_mutex_unlock(&j->lock);
+}
+
+static void queueData(inode* node, const char* buf, size_t size, off_t offset, bool exported) {
+    journal* j = node->journal;
+    if (!j) return;
+    while (size) {
+        size_t n = size < MaxRecordData ? size : MaxRecordData;
+        record r = { .type = RecordWrite, .node = node->serial, .offset = offset };
+        char* at = queueRecord(j, &r, n);
+        if (!at) return;
+        if (exported) storageExport(&node->file, at, n, offset, j->scratch);
+        else memcpy(at, buf, n);
+        queued(j, r.sequence);
+        if (buf) buf += n;
+        offset += (off_t)n;
+        size -= n;
+    }
+}
+
+static void addMilliseconds(struct timespec* ts, unsigned ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/// Takes the whole queue at once while request threads fill the other buffer, so records queued
+/// meanwhile go together in the next batch. The file is synced `interval` after the first unsynced batch
+static void* writeLoop(void* arg) {
+    journal* j = arg;
+    char* spare = NULL;
+    size_t spareCapacity = 0;
+    uint64_t written = 0; // to the current file
+    bool unsynced = false;
+    struct timespec syncBy;
+
+    pthread_mutex_lock(&j->lock);
+    for (;;) {
+        bool timedOut = false;
+        while (!j->length && j->rotateAt == SIZE_MAX && !j->stopping && !timedOut) {
+            if (!unsynced) pthread_cond_wait(&j->wake, &j->lock);
+            else timedOut = pthread_cond_timedwait(&j->wake, &j->lock, &syncBy) == ETIMEDOUT;
+        }
+        if (!j->length && j->rotateAt == SIZE_MAX) {
+            uint64_t sequence = j->sequence;
+            if (unsynced) {
+                pthread_mutex_unlock(&j->lock);
+                bool ok = fdatasync(j->fd) == 0;
+                pthread_mutex_lock(&j->lock);
+                if (ok) j->synced = sequence;
+                else j->failed = true;
+                pthread_cond_broadcast(&j->done);
+                unsynced = false;
+            }
+            if (j->stopping) break;
+            continue;
+        }
+
+        char* records = j->queue;
+        size_t length = j->length, capacity = j->capacity, rotateAt = j->rotateAt;
+        uint64_t sequence = j->sequence;
+        j->queue = spare;
+        j->capacity = spareCapacity;
+        j->length = 0;
+        spare = records;
+        spareCapacity = capacity;
+        pthread_cond_broadcast(&j->done);
+        bool failed = j->failed;
+        pthread_mutex_unlock(&j->lock);
+
+        bool ok = !failed, rotated = false;
+        if (ok && rotateAt != SIZE_MAX) {
+            ok = appendBatch(j, records, rotateAt) && rotateFile(j);
+            rotated = ok;
+            if (ok) written = 0;
+            records += rotateAt;
+            length -= rotateAt;
+        }
+        ok = ok && appendBatch(j, records, length);
+        written += length;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!unsynced) {
+            syncBy = now;
+            addMilliseconds(&syncBy, j->interval);
+        }
+        bool sync = ok && (now.tv_sec > syncBy.tv_sec || (now.tv_sec == syncBy.tv_sec && now.tv_nsec >= syncBy.tv_nsec));
+        if (sync) ok = fdatasync(j->fd) == 0;
+        if (!ok && !failed)
+            fprintf(stderr, "Warning: could not write the journal %s, changes are not journaled anymore: %s\n",
+                    j->path, strerror(errno));
+
+        pthread_mutex_lock(&j->lock);
+        if (!ok) j->failed = true;
+        if (sync) j->synced = sequence;
+        unsynced = ok && !sync;
+        if (rotateAt != SIZE_MAX) {
+            j->rotateAt = SIZE_MAX;
+            j->old = rotated;
+        }
+        pthread_cond_broadcast(&j->done);
+
+        // the saver takes its image and calls back `journalCheckpointed` or `journalCheckpointFailed`
+        if (ok && written >= CheckpointBytes && !j->checkpointing) {
+            j->checkpointing = true;
+            written = 0; // a failed save is retried after as many bytes again
+            kill(getpid(), SaveSignal);
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    free(spare);
+    return NULL;
+}
+
+/// Writes `length` bytes of records as one batch
+static bool appendBatch(journal* j, const char* records, size_t length) {
+    if (!length) return true;
+    batch b = { .magic = BatchMagic, .checksum = checksum(records, length), .length = length };
+    struct iovec vec[2] = { { &b, sizeof(b) }, { (void*)records, length } };
+    size_t left = sizeof(b) + length;
+    for (int i = 0; left;) {
+        ssize_t n = writev(j->fd, vec + i, 2 - i);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return false;
+        }
+        left -= (size_t)n;
+        for (; i < 2 && (size_t)n >= vec[i].iov_len; ++i) n -= (ssize_t)vec[i].iov_len;
+        if (i < 2) {
+            vec[i].iov_base = (char*)vec[i].iov_base + n;
+            vec[i].iov_len -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+/// Moves the synced current file to `PATH.old` and starts an empty one, both names survive a crash
+static bool rotateFile(journal* j) {
+    char old[PATH_MAX];
+    if (fdatasync(j->fd) != 0 || !oldPath(j, old) || rename(j->path, old) != 0) return false;
+    close(j->fd);
+    j->fd = openFile(j->path);
+    if (j->fd < 0) return false;
+
+    // the renames are only durable once the directory is synced
+    char* slash = strrchr(old, '/');
+    if (slash) *slash = '\0';
+    int dir = open(slash ? (slash == old ? "/" : old) : ".", O_RDONLY | O_DIRECTORY);
+    bool ok = dir >= 0 && fsync(dir) == 0;
+    if (dir >= 0) close(dir);
+    return ok;
+}
+
+/// Opens the journal at `path` for appending, with a header if it is new
+/// - Returns: the descriptor, `-1` on error
+static int openFile(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    struct stat st;
+    journalHeader header = { .magic = JournalMagic, .version = JournalVersion };
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && (write(fd, &header, sizeof(header)) != sizeof(header) ||
+                                                    fdatasync(fd) != 0))) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static bool oldPath(const journal* j, char* result) {
+    return snprintf(result, PATH_MAX, "%s.old", j->path) < PATH_MAX;
+}
+
+/// 64 bit mix of a word at a time, folded to 32 bits, enough to tell a torn batch
+static uint32_t checksum(const char* bytes, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15u ^ length;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; ++i) {
+        hash = (hash ^ (unsigned char)bytes[i]) * 0xff51afd7ed558ccdu;
+        hash ^= hash >> 29;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/// Applies the batches at `path`, a missing file has none. Replay stops at the first torn or damaged batch,
+/// which is where a crash left the file, and with `cut` the rest is cut off so that new batches follow good ones
+/// - Returns: `false` on error, `EINVAL` if it is not a journal
+static bool replayFile(replayer* r, const char* path, bool cut) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t length = (size_t)st.st_size, at = 0;
+    char* base = length >= sizeof(journalHeader) ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    if (base) {
+        const journalHeader* h = (const journalHeader*)base;
+        if (memcmp(h->magic, JournalMagic, sizeof(h->magic)) != 0 || h->version != JournalVersion) {
+            munmap(base, length);
+            close(fd);
+            errno = EINVAL;
+            return false;
+        }
+        at = sizeof(journalHeader);
+        while (length - at >= sizeof(batch)) {
+            batch b;
+            memcpy(&b, base + at, sizeof(b));
+            const char* records = base + at + sizeof(b);
+            if (b.magic != BatchMagic || b.length > length - at - sizeof(b) || checksum(records, b.length) != b.checksum)
+                break;
+
+            // records are packed one after another, so they are copied out to be read
+            for (size_t k = 0; b.length - k >= sizeof(record);) {
+                record rec;
+                memcpy(&rec, records + k, sizeof(rec));
+                if (rec.length > b.length - k - sizeof(rec)) break;
+                if (rec.sequence > r->j->fs->sequence) {
+                    applyRecord(r, &rec, records + k + sizeof(rec));
+                    if (rec.sequence > r->j->sequence) r->j->sequence = rec.sequence;
+                }
+                k += sizeof(rec) + rec.length;
+            }
+            at += sizeof(b) + (size_t)b.length;
+        }
+        munmap(base, length);
+    }
+
+    // a file too short for its header is a new one a crash caught, it gets the header again
+    if (cut && at < length) {
+        fprintf(stderr, "Warning: dropping %zu bytes torn off the end of the journal %s\n", length - at, path);
+        if (ftruncate(fd, (off_t)at) != 0 || fdatasync(fd) != 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+/// Redoes one change with the tree locked, records about inodes that are gone are skipped
+static void applyRecord(replayer* r, const record* rec, const char* data) {
+    Filesystem* fs = r->j->fs;
+    inode* node = findSerial(r, rec->node);
+    inode* other = rec->type == RecordLink || rec->type == RecordRename ? findSerial(r, rec->other) : NULL;
+    char name[NAME_MAX + 1], newName[NAME_MAX + 1];
+    bool ok = node != NULL;
+
+    switch (rec->type) {
+    case RecordLink:
+        ok = ok && isDir(node) && asDir(node) && copyName(name, data, rec->length);
+        if (ok && !other) { // first linked here
+            other = newNode(fs, rec->mode, rec->uid, rec->gid);
+            if (other) other->serial = rec->other;
+            if (other && !addSerial(r, other)) {
+                dropNode(other);
+                other = NULL;
+            }
+            if (rec->other > fs->serials) fs->serials = rec->other;
+        }
+        ok = ok && other && linkNode(node, name, other);
+        break;
+    case RecordUnlink:
+        ok = ok && isDir(node) && asDir(node) && copyName(name, data, rec->length) && unlinkNode(node, name);
+        break;
+    case RecordRename: {
+        size_t n = rec->length ? strnlen(data, (size_t)rec->length) : 0;
+        ok = ok && other && isDir(node) && asDir(node) && isDir(other) && asDir(other) && n < rec->length &&
+             copyName(name, data, n) && copyName(newName, data + n + 1, (size_t)rec->length - n - 1) &&
+             relinkNode(node, name, other, newName);
+        break;
+    }
+    case RecordAttributes:
+        ok = ok && (node->mode & S_IFMT) == (rec->mode & S_IFMT);
+        if (ok) {
+            node->mode = rec->mode;
+            node->uid = rec->uid;
+            node->gid = rec->gid;
+        }
+        break;
+    case RecordTruncate:
+        ok = ok && isFile(node);
+        if (ok) {
+            writeLock(node);
+            ok = truncateNode(node, rec->size);
+            unlock(node);
+        }
+        break;
+    case RecordWrite:
+        ok = ok && isFile(node);
+        if (ok) {
+            writeLock(node);
+            ok = writeNode(node, data, (size_t)rec->length, rec->offset) >= 0;
+            unlock(node);
+        }
+        break;
+    case RecordAllocate:
+        ok = ok && isFile(node);
+        if (ok) {
+            writeLock(node);
+            ok = allocateNode(node, (int)rec->mode, rec->offset, rec->size);
+            unlock(node);
+        }
+        break;
+    default:
+        ok = false;
+    }
+
+    if (ok) r->applied++;
+    else r->skipped++;
+}
+
+/// Maps the serial of every inode reachable from `root`, breadth first through the map itself
+static bool collectSerials(replayer* r, inode* root) {
+    size_t count = 0, capacity = 64;
+    inode** queue = malloc(capacity * sizeof(inode*));
+    if (!queue || !addSerial(r, root)) {
+        free(queue);
+        return false;
+    }
+    queue[count++] = root;
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; ++i) {
+        if (!isDir(queue[i]) || !asDir(queue[i])) continue;
+        for (entry* p = asDir(queue[i])->first->next->next; ok && p; p = p->next) {
+            if (findSerial(r, p->node->serial)) continue; // a hard link
+            if (count == capacity) {
+                inode** grown = realloc(queue, capacity * 2 * sizeof(inode*));
+                if (!grown) {
+                    errno = ENOMEM;
+                    ok = false;
+                    break;
+                }
+                queue = grown;
+                capacity *= 2;
+            }
+            ok = addSerial(r, p->node);
+            queue[count++] = p->node;
+        }
+    }
+    free(queue);
+    return ok;
+}
+
+#define serialSlot(serial, capacity) ((size_t)(((serial) * 0x9e3779b97f4a7c15u) >> 32) & ((capacity) - 1))
+
+static inode* findSerial(replayer* r, uint64_t serial) {
+    if (!r->capacity) return NULL;
+    for (size_t i = serialSlot(serial, r->capacity);; i = (i + 1) & (r->capacity - 1)) {
+        if (!r->slots[i]) return NULL;
+        if (r->slots[i]->serial == serial) return r->slots[i];
+    }
+}
+
+/// Maps `node` and keeps it open until the replay is done
+static bool addSerial(replayer* r, inode* node) {
+    if ((r->count + 1) * 2 > r->capacity) {
+        size_t capacity = r->capacity ? r->capacity * 2 : 1024;
+        inode** slots = calloc(capacity, sizeof(inode*));
+        if (!slots) {
+            errno = ENOMEM;
+            return false;
+        }
+        for (size_t i = 0; i < r->capacity; ++i) {
+            if (!r->slots[i]) continue;
+            size_t k = serialSlot(r->slots[i]->serial, capacity);
+            while (slots[k]) k = (k + 1) & (capacity - 1);
+            slots[k] = r->slots[i];
+        }
+        free(r->slots);
+        r->slots = slots;
+        r->capacity = capacity;
+    }
+    if (!openNode(node)) return false;
+    size_t k = serialSlot(node->serial, r->capacity);
+    while (r->slots[k]) k = (k + 1) & (r->capacity - 1);
+    r->slots[k] = node;
+    r->count++;
+    return true;
+}
+
+/// Copies a name of `length` bytes out of a record, it has to be one `linkNode` could have taken
+static bool copyName(char* result, const char* data, size_t length) {
+    if (!length || length > NAME_MAX || memchr(data, '\0', length) || memchr(data, Split, length)) return false;
+    memcpy(result, data, length);
+    result[length] = '\0';
+    return strcmp(result, ".") != 0 && strcmp(result, "..") != 0;
+}
@@ -0,0 +1,38 @@
+#ifndef journal_h
+#define journal_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "Filesystem.h"
+
+/// Write ahead log of the changes made since the image was saved, replayed over it at mount.
+/// Request threads only copy records into memory, a writer thread appends them to the file in batches
+/// and syncs it at most every interval. Saving the image starts a new file, the old one goes once the
+/// image is safely there. Replay starts past the sequence the image was saved at. Links, unlinks and renames
+/// are not idempotent: they are right because `saveImage` takes that sequence with `journalRotate` and collects
+/// the tree under the same tree lock they are queued under, so the image has exactly the ones up to it. Writes,
+/// truncations and attributes go on while the pages are saved, so the image may have some past it, replaying
+/// those is harmless since each sets something to a value
+
+typedef struct journal journal;
+
+journal* openJournal(Filesystem* fs, const char* path, unsigned interval);
+bool startJournal(journal* j);
+void closeJournal(journal* j);
+uint64_t journalRotate(journal* j);
+void journalCheckpointed(journal* j);
+void journalCheckpointFailed(journal* j);
+
+void journalLink(inode* dirNode, const char* name, inode* node);
+void journalUnlink(inode* dirNode, const char* name);
+void journalRename(inode* dirNode, const char* name, inode* newDirNode, const char* newName);
+void journalAttributes(inode* node);
+void journalTruncate(inode* node);
+void journalWrite(inode* node, const char* buf, size_t size, off_t offset);
+void journalWritten(inode* node, size_t size, off_t offset);
+void journalAllocate(inode* node, int mode, off_t offset, off_t length);
+
+#endif /* journal_h */
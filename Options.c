@@ -0,0 +1,202 @@
+#define FUSE_USE_VERSION 26
+
+#include "Options.h"
+#include "Image.h"
+#include "Journal.h"
+#include "Arena.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+enum { KeySize, KeyInodes, KeyNuma, KeyHuge };
+
+static const struct fuse_opt specs[] = {
+    // libfuse knows these two too, they are taken here so that `negotiate` applies them in both front ends
+    { "max_write=%u", offsetof(options, maxWrite), 0 },
+    { "max_readahead=%u", offsetof(options, maxReadahead), 0 },
+    { "dedup", offsetof(options, dedup), 1 },
+    { "compress_after=%u", offsetof(options, compressAfter), 0 },
+    { "image=%s", offsetof(options, image), 0 },
+    { "journal=%s", offsetof(options, journal), 0 },
+    { "journal_sync=%u", offsetof(options, journalSync), 0 },
+    // same as tmpfs
+    FUSE_OPT_KEY("size=", KeySize),
+    FUSE_OPT_KEY("nr_inodes=", KeyInodes),
+    FUSE_OPT_KEY("numa=", KeyNuma),
+    FUSE_OPT_KEY("hugepages=", KeyHuge),
+    FUSE_OPT_END
+};
+
+/// Parses `N` with an optional binary `k`, `m` or `g` suffix, or with `%` of the memory if `percent` is allowed
+/// - Returns: `false` if that is not a valid size
+static bool parseSize(const char* text, bool percent, size_t* result) {
+    char* end;
+    unsigned long long n = strtoull(text, &end, 10);
+    if (end == text) return false;
+
+    size_t memory = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+    switch (*end) {
+    case 'k': case 'K': n <<= 10; ++end; break;
+    case 'm': case 'M': n <<= 20; ++end; break;
+    case 'g': case 'G': n <<= 30; ++end; break;
+    case '%':
+        if (!percent || n > 100) return false;
+        n = memory / 100 * n;
+        ++end;
+        break;
+    }
+    if (*end) return false;
+
+    *result = (size_t)n;
+    return true;
+}
+
+/// Parses `local`, `interleave` or a node number
+/// - Returns: `false` if that is none of them
+static bool parseNuma(const char* text, options* opts) {
+    if (strcmp(text, "local") == 0) {
+        opts->numa = ArenaLocal;
+        return true;
+    }
+    if (strcmp(text, "interleave") == 0) {
+        opts->numa = ArenaInterleave;
+        return true;
+    }
+    char* end;
+    long node = strtol(text, &end, 10);
+    if (end == text || *end || node < 0 || node > INT_MAX) return false;
+    opts->numa = ArenaNode;
+    opts->numaNode = (int)node;
+    return true;
+}
+
+/// Parses `transparent` or `explicit`
+/// - Returns: `false` if that is neither
+static bool parseHuge(const char* text, options* opts) {
+    if (strcmp(text, "transparent") == 0) opts->hugePages = HugeTransparent;
+    else if (strcmp(text, "explicit") == 0) opts->hugePages = HugeExplicit;
+    else return false;
+    return true;
+}
+
+static int processOption(void* data, const char* arg, int key, struct fuse_args* outargs) {
+    options* opts = data;
+    if (key != KeySize && key != KeyInodes && key != KeyNuma && key != KeyHuge) return 1; // not ours, keep it
+
+    const char* value = strchr(arg, '=') + 1;
+    bool valid = key == KeyNuma ? parseNuma(value, opts)
+        : key == KeyHuge ? parseHuge(value, opts)
+        : parseSize(value, key == KeySize, key == KeySize ? &opts->maxBytes : &opts->maxInodes);
+    if (!valid) {
+        fprintf(stderr, "Invalid mount option %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+/// Makes the `path` of an option absolute, the daemon runs in `/`
+/// - Returns: `false` on error
+static bool makeAbsolute(char** path, const char* option) {
+    if (!*path || **path == '/') return true;
+    char cwd[PATH_MAX], *absolute = NULL;
+    if (!getcwd(cwd, sizeof(cwd)) || asprintf(&absolute, "%s/%s", cwd, *path) < 0) {
+        fprintf(stderr, "Invalid mount option %s=%s\n", option, *path);
+        return false;
+    }
+    free(*path);
+    *path = absolute;
+    return true;
+}
+
+/// Takes our options out of `args`, the limits start at the tmpfs defaults
+/// - Returns: `-1` on error
+int parseOptions(struct fuse_args* args, options* opts) {
+    size_t pages = (size_t)sysconf(_SC_PHYS_PAGES);
+    opts->maxBytes = pages / 2 * (size_t)sysconf(_SC_PAGESIZE);
+    opts->maxInodes = pages / 2;
+    opts->journalSync = 100;
+    if (fuse_opt_parse(args, opts, specs, processOption) == -1) return -1;
+
+    // the journal only holds what changed since the image it is replayed over
+    if (opts->journal && !opts->image) {
+        fprintf(stderr, "Mount option journal= needs image= as well\n");
+        return -1;
+    }
+    // before the daemon forks and starts threads, so that they all run on the pinned node
+    if (!configureArena(opts->numa, opts->numaNode, opts->hugePages, opts->maxBytes)) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "Invalid mount option numa=%d, there is no such node with CPUs\n", opts->numaNode);
+            return -1;
+        }
+        fprintf(stderr, "Warning: could not reserve the arena, pages are placed by malloc: %s\n", strerror(errno));
+    }
+    return makeAbsolute(&opts->image, "image") && makeAbsolute(&opts->journal, "journal") ? 0 : -1;
+}
+
+/// Asks the kernel for the features we use, called from `init`
+void negotiate(struct fuse_conn_info* conn, const options* opts) {
+    // replies go from the pages to the device through a pipe, and writes arrive in one to be read right into the pages
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+
+    // requests as large as possible, by now `max_write` is what libfuse buffers can take (which tells the kernel
+    // to use more pages per request on FUSE 3), `max_readahead` is what the kernel offered
+#ifdef FUSE_CAP_BIG_WRITES
+    if (conn->capable & FUSE_CAP_BIG_WRITES) conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+    if (opts->maxWrite && opts->maxWrite < conn->max_write) conn->max_write = opts->maxWrite;
+    if (opts->maxReadahead && opts->maxReadahead < conn->max_readahead) conn->max_readahead = opts->maxReadahead;
+    fprintf(stderr, "Requests up to %u bytes written, %u read ahead\n", conn->max_write, conn->max_readahead);
+}
+
+/// Loads the image if there is one, an empty filesystem otherwise, and replays the journal over it. An image or
+/// a journal that is there but cannot be read is not saved over, `opts->image` and `opts->journal` are dropped then
+Filesystem* openFilesystem(options* opts) {
+    Filesystem* fs = opts->image ? loadImage(opts->image, opts->maxBytes, opts->maxInodes) : NULL;
+    if (fs) {
+        fprintf(stderr, "Loaded the image from %s\n", opts->image);
+    } else if (opts->image && errno != ENOENT) {
+        fprintf(stderr, "Warning: could not load the image from %s, starting empty and leaving it as it is: %s\n",
+                opts->image, strerror(errno));
+        free(opts->image);
+        opts->image = NULL;
+    }
+    if (!fs) fs = newFilesystem(opts->maxBytes, opts->maxInodes);
+    fs->dedup = opts->dedup;
+
+    if (opts->journal && (!opts->image || !openJournal(fs, opts->journal, opts->journalSync))) {
+        if (opts->image)
+            fprintf(stderr, "Warning: could not replay the journal %s, leaving it and the image as they are: %s\n",
+                    opts->journal, strerror(errno));
+        free(opts->image);
+        opts->image = NULL;
+        free(opts->journal);
+        opts->journal = NULL;
+    }
+    return fs;
+}
+
+/// Packs cold files in the background if asked to, called once the process is in the background for good
+void startPacking(Filesystem* fs, const options* opts) {
+    if (!opts->compressAfter) return;
+#ifdef PageCompression
+    if (!startPacker(fs, opts->compressAfter)) fprintf(stderr, "Warning: files will not be compressed\n");
+#else
+    fprintf(stderr, "Warning: compression is not built in, see `make COMPRESS=1`\n");
+#endif
+}
+
+/// Starts writing the journal and saving the image on `SaveSignal` and at unmount, if there are any. Called once the
+/// process is in the background for good
+void startSaving(Filesystem* fs, const options* opts) {
+    if (fs->journal && !startJournal(fs->journal))
+        fprintf(stderr, "Warning: the journal will only be written at unmount\n");
+    if (!opts->image) return;
+    if (!startSaver(fs, opts->image)) fprintf(stderr, "Warning: the image will only be saved at unmount\n");
+}
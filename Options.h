@@ -0,0 +1,30 @@
+#ifndef options_h
+#define options_h
+
+#include <fuse_common.h>
+
+#include "Filesystem.h"
+
+/// Mount options of our own, both front ends leave the rest to libfuse
+typedef struct options {
+    unsigned maxWrite; /// `-o max_write=N` bytes per write request, `0` for as much as the kernel and libfuse take
+    unsigned maxReadahead; /// `-o max_readahead=N` bytes, `0` for what the kernel offers
+    size_t maxBytes; /// `-o size=N[k|m|g|%]`, half of the memory by default, `0` for no limit
+    size_t maxInodes; /// `-o nr_inodes=N[k|m|g]`, as many as half of the memory pages by default, `0` for no limit
+    int dedup; /// `-o dedup`: identical pages of files are shared once the files are closed
+    unsigned compressAfter; /// `-o compress_after=S` seconds without access before a file is packed, `0` for never
+    char* image; /// `-o image=PATH` loaded at mount if it is there, saved at unmount and on `SaveSignal`, absolute
+    char* journal; /// `-o journal=PATH` of changes since the image was saved, replayed at mount, needs `image`, absolute
+    unsigned journalSync; /// `-o journal_sync=MS` milliseconds between syncs of the journal, `0` syncs every change before replying
+    int numa; /// `-o numa=local|interleave|N`: where full pages go, one of `Arena…`, left to `malloc` by default
+    int numaNode; /// `N` of `-o numa=N`, the threads run there too
+    int hugePages; /// `-o hugepages=transparent|explicit`: full pages in 2 MiB pages, one of `Huge…`, off by default
+} options;
+
+int parseOptions(struct fuse_args* args, options* opts);
+void negotiate(struct fuse_conn_info* conn, const options* opts);
+Filesystem* openFilesystem(options* opts);
+void startPacking(Filesystem* fs, const options* opts);
+void startSaving(Filesystem* fs, const options* opts);
+
+#endif /* options_h */
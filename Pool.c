@@ -0,0 +1,46 @@
+#include "Pool.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/// Slab header, objects start after it
+#define SlabHeader poolObjectSize(sizeof(void*))
+
+/// Hands out a zeroed object
+/// - Returns: `NULL` if out of memory
+void* poolAlloc(pool* p) {
+    pthread_mutex_lock(&p->lock);
+    void* object = p->free;
+    if (object) {
+        p->free = *(void**)object;
+    } else {
+        if (!p->next || p->next + p->size > p->end) {
+            char* slab = malloc(SlabSize);
+            if (!slab) {
+                pthread_mutex_unlock(&p->lock);
+                errno = ENOMEM;
+                return NULL;
+            }
+            *(void**)slab = p->slabs;
+            p->slabs = slab;
+            p->nslabs++;
+            p->next = slab + SlabHeader;
+            p->end = slab + SlabSize;
+        }
+        object = p->next;
+        p->next += p->size;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    memset(object, 0, p->size);
+    return object;
+}
+
+void poolFree(pool* p, void* object) {
+    if (!object) return;
+    pthread_mutex_lock(&p->lock);
+    *(void**)object = p->free;
+    p->free = object;
+    pthread_mutex_unlock(&p->lock);
+}
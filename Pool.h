@@ -0,0 +1,29 @@
+#ifndef pool_h
+#define pool_h
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SlabSize ((size_t)64 << 10)
+#define PoolAlign 16
+
+/// Rounded object sizes, so that every object in a slab stays aligned
+#define poolObjectSize(size) (((size) + PoolAlign - 1) & ~(size_t)(PoolAlign - 1))
+
+/// Allocator of same sized objects carved out of `SlabSize` chunks, freed objects are reused before new ones
+typedef struct pool {
+    pthread_mutex_t lock;
+    size_t size; /// of a single object, at least a pointer
+    void* free; /// freed objects linked through their first word
+    char* next; /// never used part of the newest slab
+    char* end;
+    void* slabs; /// linked through their first word, kept until exit
+    size_t nslabs;
+} pool;
+
+#define PoolInit(objectSize) { .lock = PTHREAD_MUTEX_INITIALIZER, .size = poolObjectSize(objectSize) }
+
+void* poolAlloc(pool* p);
+void poolFree(pool* p, void* object);
+
+#endif /* pool_h */
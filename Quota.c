@@ -0,0 +1,45 @@
+#include "Quota.h"
+
+#include <errno.h>
+
+/// Takes `bytes` out of the budget
+/// - Returns: `false` with `ENOSPC` if that goes over the limit, nothing is charged then
+bool charge(quota* q, size_t bytes) {
+    if (!q || !bytes) return true;
+    size_t used = atomic_fetch_add(&q->bytes, bytes) + bytes;
+    if (q->maxBytes && used > q->maxBytes) {
+        atomic_fetch_sub(&q->bytes, bytes);
+        errno = ENOSPC;
+        return false;
+    }
+    return true;
+}
+
+void refund(quota* q, size_t bytes) {
+    if (q && bytes) atomic_fetch_sub(&q->bytes, bytes);
+}
+
+/// Takes `bytes` even past the limit, for what cannot fail
+void overcharge(quota* q, size_t bytes) {
+    if (q && bytes) atomic_fetch_add(&q->bytes, bytes);
+}
+
+/// Same as `charge` for one more inode of `bytes`
+bool chargeInode(quota* q, size_t bytes) {
+    if (!q) return true;
+    size_t used = atomic_fetch_add(&q->inodes, 1) + 1;
+    if (q->maxInodes && used > q->maxInodes) {
+        atomic_fetch_sub(&q->inodes, 1);
+        errno = ENOSPC;
+        return false;
+    }
+    if (charge(q, bytes)) return true;
+    atomic_fetch_sub(&q->inodes, 1);
+    return false;
+}
+
+void refundInode(quota* q, size_t bytes) {
+    if (!q) return;
+    atomic_fetch_sub(&q->inodes, 1);
+    refund(q, bytes);
+}
@@ -0,0 +1,22 @@
+#ifndef quota_h
+#define quota_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Usage and limits of a filesystem, `NULL` counts nothing
+typedef struct quota {
+    _Atomic size_t bytes; /// file pages and page tables, inodes, entries and directories
+    _Atomic size_t inodes;
+    size_t maxBytes; /// `0` for no limit
+    size_t maxInodes; /// `0` for no limit
+} quota;
+
+bool charge(quota* q, size_t bytes);
+void refund(quota* q, size_t bytes);
+void overcharge(quota* q, size_t bytes);
+bool chargeInode(quota* q, size_t bytes);
+void refundInode(quota* q, size_t bytes);
+
+#endif /* quota_h */
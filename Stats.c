@@ -0,0 +1,177 @@
+#include "Stats.h"
+
+#ifdef Statistics
+#include "Arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+/// More shards than CPUs are never touched, fewer are shared
+#define NShards 64
+
+/// Log-linear buckets of nanoseconds up to `1 << MaxShift`: below `1 << SubBits` one each, above that
+/// `1 << SubBits` for every power of two, split by the bits after the leading one, about 6% of error
+#define SubBits 4
+#define MaxShift 40
+#define NLatencies ((MaxShift - SubBits + 1) << SubBits)
+
+static const char* opNames[NStatOps] = {
+    "getattr", "mknod", "mkdir", "unlink", "rmdir", "rename", "link", "open", "read", "write",
+    "release", "truncate", "fallocate", "opendir", "readdir",
+    "releasedir", "statfs", "getxattr"
+};
+
+typedef struct {
+    alignas(64) _Atomic uint64_t latencies[NStatOps][NLatencies];
+    _Atomic uint64_t nanoseconds[NStatOps];
+    _Atomic int64_t counters[NStatCounters];
+} shard;
+
+static shard shards[NShards];
+
+/// Threads moving between CPUs only make a shard shared for a while, the counts stay exact
+static shard* localShard(void) {
+    int cpu = sched_getcpu();
+    return &shards[(unsigned)(cpu < 0 ? 0 : cpu) % NShards];
+}
+
+static uint64_t clockNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+statTimer startTimer(int op) {
+    return (statTimer){ op, clockNanoseconds() };
+}
+
+void stopTimer(statTimer* timer) {
+    uint64_t ns = clockNanoseconds() - timer->start;
+    uint64_t clamped = ns < (1ull << MaxShift) ? ns : (1ull << MaxShift) - 1;
+    int bucket = (int)clamped;
+    if (clamped >= (1u << SubBits)) {
+        int shift = 64 - __builtin_clzll(clamped) - SubBits - 1;
+        bucket = ((shift + 1) << SubBits) | (int)((clamped >> shift) & ((1u << SubBits) - 1));
+    }
+
+    shard* s = localShard();
+    atomic_fetch_add_explicit(&s->latencies[timer->op][bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->nanoseconds[timer->op], ns, memory_order_relaxed);
+}
+
+void addStat(int counter, int64_t delta) {
+    atomic_fetch_add_explicit(&localShard()->counters[counter], delta, memory_order_relaxed);
+}
+
+/// Sum of every shard, not a snapshot taken at one instant
+typedef struct {
+    uint64_t latencies[NStatOps][NLatencies];
+    uint64_t calls[NStatOps];
+    uint64_t nanoseconds[NStatOps];
+    int64_t counters[NStatCounters];
+} totals;
+
+static void sumShards(totals* t) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF); // the shards past them stay empty
+    int n = cpus > 0 && cpus < NShards ? (int)cpus : NShards;
+    for (int i = 0; i < n; ++i) {
+        shard* s = &shards[i];
+        for (int op = 0; op < NStatOps; ++op) {
+            for (int b = 0; b < NLatencies; ++b) {
+                uint64_t n = atomic_load_explicit(&s->latencies[op][b], memory_order_relaxed);
+                t->latencies[op][b] += n;
+                t->calls[op] += n;
+            }
+            t->nanoseconds[op] += atomic_load_explicit(&s->nanoseconds[op], memory_order_relaxed);
+        }
+        for (int c = 0; c < NStatCounters; ++c)
+            t->counters[c] += atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+    }
+}
+
+/// Upper bound of the bucket the `fraction` of the calls fall in, in microseconds
+static double percentile(const totals* t, int op, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * t->calls[op]), seen = 0;
+    for (int b = 0; b < NLatencies; ++b) {
+        seen += t->latencies[op][b];
+        if (seen > rank) {
+            uint64_t sub = (uint64_t)(b & ((1 << SubBits) - 1)) + 1;
+            if (b < (1 << SubBits)) return (double)sub / 1000;
+            int shift = (b >> SubBits) - 1;
+            return (double)(((1ull << SubBits) + sub) << shift) / 1000;
+        }
+    }
+    return 0;
+}
+
+static double ratio(int64_t part, int64_t whole) {
+    return whole > 0 ? (double)part / whole : 0;
+}
+
+/// Text or JSON with every handler called so far, the counters and the usage in `q`
+/// - Returns: `malloc`ed text of `length` bytes, `NULL` if out of memory
+char* formatStats(const quota* q, bool json, size_t* length) {
+    totals* t = calloc(1, sizeof(totals));
+    char* text = NULL;
+    FILE* out = t ? open_memstream(&text, length) : NULL;
+    if (!out) {
+        free(t);
+        return NULL;
+    }
+    sumShards(t);
+
+    int64_t* c = t->counters;
+    double pathHits = ratio(c[StatPathHits], c[StatPathHits] + c[StatPathMisses]);
+    double keptCaches = ratio(c[StatKeptCaches], c[StatKeptCaches] + c[StatDroppedCaches]);
+    double load = ratio(c[StatEntries], c[StatSlots]);
+    size_t inodes = atomic_load(&q->inodes), bytes = atomic_load(&q->bytes);
+    arenaUsage arena = arenaStats();
+
+    if (json) fprintf(out, "{\"ops\":{");
+    else fprintf(out, "%-16s %12s %10s %10s %10s %10s\n", "op", "calls", "mean_us", "p50_us", "p99_us", "p999_us");
+    for (int op = 0, first = 1; op < NStatOps; ++op) {
+        if (!t->calls[op]) continue;
+        double mean = t->nanoseconds[op] / 1000.0 / t->calls[op];
+        double p50 = percentile(t, op, 0.5), p99 = percentile(t, op, 0.99), p999 = percentile(t, op, 0.999);
+        if (json)
+            fprintf(out, "%s\"%s\":{\"calls\":%llu,\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f}",
+                    first ? "" : ",", opNames[op], (unsigned long long)t->calls[op], mean, p50, p99, p999);
+        else
+            fprintf(out, "%-16s %12llu %10.2f %10.2f %10.2f %10.2f\n", opNames[op],
+                    (unsigned long long)t->calls[op], mean, p50, p99, p999);
+        first = 0;
+    }
+
+    if (json)
+        fprintf(out, "},\"inodes\":%zu,\"bytes\":%zu,\"directory_entries\":%lld,\"directory_slots\":%lld,"
+                     "\"directory_load\":%.3f,\"path_cache_hits\":%lld,\"path_cache_misses\":%lld,"
+                     "\"path_cache_hit_rate\":%.3f,\"page_cache_kept\":%lld,\"page_cache_dropped\":%lld,"
+                     "\"page_cache_hit_rate\":%.3f,\"arena_bytes\":%zu,\"explicit_huge_bytes\":%zu,"
+                     "\"transparent_huge_bytes\":%zu}\n",
+                inodes, bytes, (long long)c[StatEntries], (long long)c[StatSlots], load,
+                (long long)c[StatPathHits], (long long)c[StatPathMisses], pathHits,
+                (long long)c[StatKeptCaches], (long long)c[StatDroppedCaches], keptCaches,
+                arena.bytes, arena.explicitHuge, arena.transparentHuge);
+    else
+        fprintf(out, "\ninodes %zu\nbytes %zu\ndirectory_entries %lld\ndirectory_slots %lld\ndirectory_load %.3f\n"
+                     "path_cache_hits %lld\npath_cache_misses %lld\npath_cache_hit_rate %.3f\n"
+                     "page_cache_kept %lld\npage_cache_dropped %lld\npage_cache_hit_rate %.3f\n"
+                     "arena_bytes %zu\nexplicit_huge_bytes %zu\ntransparent_huge_bytes %zu\n",
+                inodes, bytes, (long long)c[StatEntries], (long long)c[StatSlots], load,
+                (long long)c[StatPathHits], (long long)c[StatPathMisses], pathHits,
+                (long long)c[StatKeptCaches], (long long)c[StatDroppedCaches], keptCaches,
+                arena.bytes, arena.explicitHuge, arena.transparentHuge);
+
+    free(t);
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+#endif
@@ -0,0 +1,49 @@
+#ifndef stats_h
+#define stats_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Quota.h"
+
+/// Calls, latency histograms and counters of the process, kept per CPU so that threads do not share cache lines,
+/// and summed only when read. Built with `-DStatistics`, otherwise the macros below compile to nothing
+
+enum {
+    StatGetattr, StatMknod, StatMkdir, StatUnlink, StatRmdir, StatRename, StatLink, StatOpen, StatRead, StatWrite,
+    StatRelease, StatTruncate, StatFallocate, StatOpendir, StatReaddir,
+    StatReleasedir, StatStatfs, StatGetxattr, NStatOps
+};
+
+enum {
+    StatPathHits, StatPathMisses, /// lookups answered by the cache of paths, or not
+    StatKeptCaches, StatDroppedCaches, /// opens where the pages in the kernel were still good, or not
+    StatEntries, StatSlots, /// in all the directory indexes
+    NStatCounters
+};
+
+#ifdef Statistics
+/// Virtual read only directory at the root with `StatsFile` in text and `StatsFile.json`
+#define StatsDirectory "/.ramfs"
+#define StatsFile "stats"
+
+typedef struct {
+    int op;
+    uint64_t start;
+} statTimer;
+
+statTimer startTimer(int op);
+void stopTimer(statTimer* timer);
+void addStat(int counter, int64_t delta);
+char* formatStats(const quota* q, bool json, size_t* length);
+
+/// Times the handler it starts, up to whichever return leaves it
+#define measure(op) __attribute__((cleanup(stopTimer))) statTimer timer_ = startTimer(op)
+#define countStat(counter, delta) addStat(counter, delta)
+#else
+#define measure(op) ((void)0)
+#define countStat(counter, delta) ((void)0)
+#endif
+
+#endif /* stats_h */
@@ -0,0 +1,761 @@
+#include "Storage.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "Pool.h"
+#include "Arena.h"
+
+#ifdef PageCompression
+#include <lz4.h>
+
+/// Packed pages are tagged in the tree by the lowest pointer bit
+#define isPacked(p) ((uintptr_t)(p) & 1)
+#define asPacked(p) ((packedPage*)((uintptr_t)(p) - 1))
+#define tagPacked(p) ((void*)((uintptr_t)(p) + 1))
+/// Smaller pages are not worth it
+#define MinPackedCapacity 4096
+#else
+#define isPacked(p) false
+#endif
+
+#define pageOf(offset) ((size_t)(offset) >> PageShift)
+#define inPage(offset) ((size_t)(offset) & (PageSize - 1))
+
+/// Number of pages under a subtree with `height` levels of tables
+#define coveredPages(height) ((size_t)1 << ((height) * TableShift))
+#define slotOf(index, height) (((index) >> (((height) - 1) * TableShift)) & (TableSize - 1))
+
+/// Backs the holes handed out by `storageMap`
+static const char zeroes[PageSize];
+
+/// Full pages by contents, for `storageDedup`
+typedef struct storeEntry {
+    uint64_t hash;
+    page* page;
+    quota* owner; /// pages are only shared within a filesystem
+    struct storeEntry* next;
+} storeEntry;
+
+/// Chained hash table, an entry goes away with its page
+static struct {
+    pthread_mutex_t lock; /// guards the table and `refs` of the pages in it
+    storeEntry** buckets;
+    size_t capacity; /// a power of two
+    size_t count;
+} store = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pool storeEntries = PoolInit(sizeof(storeEntry));
+
+static void** findSlot(const storage* s, size_t index);
+static page* findPage(const storage* s, size_t index);
+static void** reserveSlot(storage* s, quota* q, size_t index);
+static page* reservePage(storage* s, quota* q, size_t index, size_t end);
+static void* prune(storage* s, quota* q, void* p, unsigned height, size_t base, size_t first, size_t end);
+static bool zeroPage(storage* s, quota* q, size_t index, size_t start, size_t end, bool force);
+static size_t findNext(void* p, unsigned height, size_t base, size_t index, bool data);
+static _Atomic uint32_t* refsOf(void* p);
+static void countLeaf(storage* s, const void* p, bool add);
+static void dropLeaf(storage* s, quota* q, void* p);
+static page* ownPage(storage* s, quota* q, void** slot, bool force);
+static void dedupTree(storage* s, quota* q, void** slot, unsigned height);
+static uint64_t hashPage(const char* bytes);
+static void unindex(page* p);
+#ifdef PageCompression
+static void packTree(storage* s, quota* q, void** slot, unsigned height, char* scratch);
+static page* unpackPage(storage* s, quota* q, void** slot, bool force);
+#endif
+
+/// Copies `size` bytes at `offset` into `buf`, the range has to be inside the file and unpacked
+void storageRead(storage* s, char* buf, size_t size, off_t offset) {
+    while (size) {
+        size_t index = pageOf(offset), start = inPage(offset);
+        size_t n = PageSize - start;
+        if (n > size) n = size;
+
+        page* p = findPage(s, index);
+        size_t have = p && p->capacity > start ? p->capacity - start : 0;
+        if (have > n) have = n;
+        if (have) memcpy(buf, p->bytes + start, have);
+        memset(buf + have, 0, n - have);
+
+        buf += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+/// Same as `storageRead`, but packed pages are decompressed into `scratch` of `PageSize` bytes rather than unpacked in place
+void storageExport(storage* s, char* buf, size_t size, off_t offset, char* scratch) {
+    while (size) {
+        size_t index = pageOf(offset), start = inPage(offset);
+        size_t n = PageSize - start;
+        if (n > size) n = size;
+
+        void** slot = findSlot(s, index);
+        void* p = slot ? *slot : NULL;
+        const char* bytes = NULL;
+        size_t capacity = 0;
+#ifdef PageCompression
+        if (isPacked(p)) {
+            packedPage* packed = asPacked(p);
+            LZ4_decompress_safe(packed->bytes, scratch, (int)packed->length, (int)packed->capacity);
+            bytes = scratch;
+            capacity = packed->capacity;
+        } else
+#endif
+        if (p) {
+            bytes = ((page*)p)->bytes;
+            capacity = ((page*)p)->capacity;
+        }
+        size_t have = capacity > start ? capacity - start : 0;
+        if (have > n) have = n;
+        if (have) memcpy(buf, bytes + start, have);
+        memset(buf + have, 0, n - have);
+
+        buf += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+/// Same as `storageRead`, but points `vec` at the pages instead of copying, holes point at shared zeroes.
+/// The segments stay valid until the storage is changed, the range has to be unpacked
+/// - Returns: number of segments filled, at most `storageMapCapacity(size)`
+size_t storageMap(storage* s, struct iovec* vec, size_t size, off_t offset) {
+    size_t count = 0;
+    while (size) {
+        size_t index = pageOf(offset), start = inPage(offset);
+        size_t n = PageSize - start;
+        if (n > size) n = size;
+
+        page* p = findPage(s, index);
+        size_t have = p && p->capacity > start ? p->capacity - start : 0;
+        if (have > n) have = n;
+        if (have) vec[count++] = (struct iovec){ p->bytes + start, have };
+        if (n > have) vec[count++] = (struct iovec){ (void*)zeroes, n - have };
+
+        offset += n;
+        size -= n;
+    }
+    return count;
+}
+
+/// Copies `size` bytes from `buf` to `offset`, allocating pages on the way and charging them to `q`
+/// - Returns: `false` if out of memory or over the quota, some of the pages might be written already
+bool storageWrite(storage* s, quota* q, const char* buf, size_t size, off_t offset) {
+    while (size) {
+        size_t index = pageOf(offset), start = inPage(offset);
+        size_t n = PageSize - start;
+        if (n > size) n = size;
+
+        page* p = reservePage(s, q, index, start + n);
+        if (!p) return false;
+        memcpy(p->bytes + start, buf, n);
+
+        buf += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+/// Allocates the pages under `size` bytes at `offset`, so that `storageMap` points into them for writing in place
+/// - Returns: `false` if out of memory or over the quota, some of the pages might be allocated already
+bool storageReserve(storage* s, quota* q, size_t size, off_t offset) {
+    while (size) {
+        size_t index = pageOf(offset), start = inPage(offset);
+        size_t n = PageSize - start;
+        if (n > size) n = size;
+
+        if (!reservePage(s, q, index, start + n)) return false;
+
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+/// Frees pages past `size`, and the tables left empty, and zeroes the tail of the last page, so extending the file reads zeros again
+void storageTruncate(storage* s, quota* q, off_t size) {
+    size_t keep = pageOf(size + PageSize - 1);
+    s->root = prune(s, q, s->root, s->height, 0, keep, SIZE_MAX);
+    if (!s->root) s->height = 0;
+
+    if (inPage(size)) zeroPage(s, q, keep - 1, inPage(size), PageSize, true);
+}
+
+/// Turns `size` bytes at `offset` into zeros, the pages they cover as a whole into holes
+void storagePunch(storage* s, quota* q, size_t size, off_t offset) {
+    if (!size) return;
+    size_t first = pageOf(offset), last = pageOf(offset + size - 1);
+    if (first == last) {
+        zeroPage(s, q, first, inPage(offset), inPage(offset) + size, true);
+        return;
+    }
+
+    size_t from = inPage(offset) ? first + 1 : first, to = inPage(offset + size) ? last : last + 1;
+    if (inPage(offset)) zeroPage(s, q, first, inPage(offset), PageSize, true);
+    if (inPage(offset + size)) zeroPage(s, q, last, 0, inPage(offset + size), true);
+    s->root = prune(s, q, s->root, s->height, 0, from, to);
+    if (!s->root) s->height = 0;
+}
+
+/// Copies `size` bytes at `fromOffset` in `from` to `offset`, allocating pages on the way and charging them to `q`,
+/// holes of `from` stay holes where `s` has none. Both have to be locked, they can be the same storage
+/// if the ranges do not overlap, and the source range has to be unpacked
+/// - Returns: `false` if out of memory or over the quota, some of the bytes might be copied already
+bool storageCopy(storage* s, quota* q, storage* from, size_t size, off_t fromOffset, off_t offset) {
+    while (size) {
+        size_t index = pageOf(offset), start = inPage(offset);
+        size_t n = PageSize - start;
+        if (n > size) n = size;
+
+        if (!findPage(from, pageOf(fromOffset)) && !findPage(from, pageOf(fromOffset + n - 1))) {
+            if (!zeroPage(s, q, index, start, start + n, false)) return false;
+        } else {
+            page* p = reservePage(s, q, index, start + n);
+            if (!p) return false;
+            storageRead(from, p->bytes + start, n, fromOffset); // looks the source up again, it might be `p`
+        }
+
+        fromOffset += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+void storageRelease(storage* s, quota* q) {
+    prune(s, q, s->root, s->height, 0, 0, SIZE_MAX);
+    s->root = NULL;
+    s->height = 0;
+}
+
+/// Shares full pages with the same contents as pages of other files, and drops the ones holding zeros only.
+/// Whoever writes a shared page gets a copy of it first
+void storageDedup(storage* s, quota* q) {
+    dedupTree(s, q, &s->root, s->height);
+}
+
+/// Makes `count` pages of `s` from `toPage` on the same as pages of `from` from `fromPage` on, holes
+/// included, by sharing them. Only the tables are allocated, what was there before is dropped.
+/// Both have to be locked, they can be the same storage
+/// - Returns: `false` if out of memory or over the quota, some of the pages might be shared already
+bool storageClone(storage* s, quota* q, storage* from, size_t count, size_t fromPage, size_t toPage) {
+    // an overlapping range later in the same storage is filled from the end
+    bool backwards = s == from && toPage > fromPage;
+    for (size_t k = 0; k < count; ++k) {
+        size_t i = backwards ? count - 1 - k : k;
+        void** source = findSlot(from, fromPage + i);
+        void* p = source ? *source : NULL;
+        void** slot = p ? reserveSlot(s, q, toPage + i) : findSlot(s, toPage + i);
+        if (p && !slot) return false;
+        if (!slot || *slot == p) continue;
+
+        if (p) {
+            if (atomic_load(refsOf(p)) != PinnedRefs) atomic_fetch_add(refsOf(p), 1);
+            countLeaf(s, p, true);
+        }
+        if (*slot) dropLeaf(s, q, *slot);
+        *slot = p;
+    }
+    return true;
+}
+
+/// Finds the first allocated page from `index` on, for walking all of them in order
+/// - Returns: its bytes and their `capacity`, packed pages are decompressed into `scratch` of `PageSize` bytes,
+///   `NULL` if there are no more pages
+const char* storageNext(storage* s, size_t* index, size_t* capacity, char* scratch) {
+    if (*index >= coveredPages(s->height)) return NULL;
+    size_t found = findNext(s->root, s->height, 0, *index, true);
+    if (found == SIZE_MAX) return NULL;
+    *index = found;
+
+    void* p = *findSlot(s, found);
+#ifdef PageCompression
+    if (isPacked(p)) {
+        packedPage* packed = asPacked(p);
+        LZ4_decompress_safe(packed->bytes, scratch, (int)packed->length, (int)packed->capacity);
+        *capacity = packed->capacity;
+        return scratch;
+    }
+#endif
+    *capacity = ((page*)p)->capacity;
+    return ((page*)p)->bytes;
+}
+
+/// Hangs pinned page `p` at the `index` hole, only the tables it takes are charged to `q`
+/// - Returns: `false` if out of memory or over the quota
+bool storageAdopt(storage* s, quota* q, size_t index, page* p) {
+    assert(atomic_load(&p->refs) == PinnedRefs);
+    void** slot = reserveSlot(s, q, index);
+    if (!slot) return false;
+    assert(!*slot);
+    *slot = p;
+    countLeaf(s, p, true);
+    return true;
+}
+
+/// `SEEK_DATA` or `SEEK_HOLE` from `offset` in a file of `size` bytes, holes are unallocated pages and the end of file
+/// - Returns: the found offset, `-1` with `ENXIO` if `offset` is past the end or there is no data after it
+off_t storageSeek(storage* s, off_t offset, int whence, off_t size) {
+    if (offset < 0 || offset >= size) {
+        errno = ENXIO;
+        return -1;
+    }
+
+    bool data = whence == SEEK_DATA;
+    size_t i = pageOf(offset), covered = coveredPages(s->height);
+    size_t found = i < covered ? findNext(s->root, s->height, 0, i, data) : SIZE_MAX;
+    if (!data && found == SIZE_MAX) found = i < covered ? covered : i; // nothing is allocated past the tree
+
+    if (found >= pageOf(size + PageSize - 1)) {
+        if (!data) return size;
+        errno = ENXIO;
+        return -1;
+    }
+
+    off_t at = (off_t)found << PageShift;
+    return at < offset ? offset : at;
+}
+
+#ifdef PageCompression
+/// Compresses every page worth it, for a file nobody touched for a while
+void storagePack(storage* s, quota* q) {
+    char* scratch = malloc((size_t)LZ4_compressBound((int)PageSize));
+    if (!scratch) return;
+    packTree(s, q, &s->root, s->height, scratch);
+    free(scratch);
+}
+
+/// Tells if any page under `size` bytes at `offset` is packed
+bool storagePacked(storage* s, size_t size, off_t offset) {
+    if (!s->packed || !size) return false;
+    for (size_t i = pageOf(offset), end = pageOf(offset + size - 1); i <= end; ++i) {
+        void** slot = findSlot(s, i);
+        if (slot && isPacked(*slot)) return true;
+    }
+    return false;
+}
+
+/// Decompresses packed pages under `size` bytes at `offset`, so that they can be read or mapped
+/// - Returns: `false` if out of memory or over the quota, some of the pages might be unpacked already
+bool storageUnpack(storage* s, quota* q, size_t size, off_t offset) {
+    if (!s->packed || !size) return true;
+    for (size_t i = pageOf(offset), end = pageOf(offset + size - 1); i <= end; ++i) {
+        void** slot = findSlot(s, i);
+        if (slot && isPacked(*slot) && !unpackPage(s, q, slot, false)) return false;
+    }
+    return true;
+}
+#endif
+
+/// Walks down to the slot of the `index` page
+/// - Returns: `NULL` if the tables on the way are missing
+static void** findSlot(const storage* s, size_t index) {
+    if (index >= coveredPages(s->height)) return NULL;
+    void* const* slot = &s->root;
+    for (unsigned h = s->height; h; --h) {
+        if (!*slot) return NULL;
+        slot = &((pageTable*)*slot)->slots[slotOf(index, h)];
+    }
+    return (void**)slot;
+}
+
+/// - Returns: `NULL` for a hole
+static page* findPage(const storage* s, size_t index) {
+    void** slot = findSlot(s, index);
+    page* p = slot ? *slot : NULL;
+#ifdef PageCompression
+    assert(!isPacked(p)); // callers unpack first
+#endif
+    return p;
+}
+
+static pageTable* newTable(quota* q) {
+    if (!charge(q, sizeof(pageTable))) return NULL;
+    pageTable* table = calloc(1, sizeof(pageTable));
+    if (!table) {
+        refund(q, sizeof(pageTable));
+        errno = ENOSPC;
+    }
+    return table;
+}
+
+/// Finds where the `index` page hangs, growing the tree at the top and adding tables on the way down
+/// - Returns: `NULL` if out of memory or over the quota
+static void** reserveSlot(storage* s, quota* q, size_t index) {
+    while (index >= coveredPages(s->height)) {
+        // whatever is there becomes the first slot of the new root
+        if (s->root) {
+            pageTable* table = newTable(q);
+            if (!table) return NULL;
+            table->slots[0] = s->root;
+            s->root = table;
+        }
+        s->height++;
+    }
+
+    void** slot = &s->root;
+    for (unsigned h = s->height; h; --h) {
+        if (!*slot && !(*slot = newTable(q))) return NULL;
+        slot = &((pageTable*)*slot)->slots[slotOf(index, h)];
+    }
+    return slot;
+}
+
+/// Room for a page of `capacity` bytes, full ones from the arena
+static page* allocPage(size_t capacity) {
+    page* p = capacity == PageSize ? arenaAlloc() : NULL;
+    return p ? p : malloc(sizeof(page) + capacity);
+}
+
+/// Moves `p` with `have` bytes into room for `capacity`, like `realloc`
+static page* growPage(page* p, size_t have, size_t capacity) {
+    if (capacity < PageSize) return realloc(p, sizeof(page) + capacity);
+    page* full = arenaAlloc();
+    if (!full) return realloc(p, sizeof(page) + capacity);
+    if (p) {
+        memcpy(full, p, sizeof(page) + have);
+        free(p); // only full pages are in the arena
+    }
+    return full;
+}
+
+static void freePage(void* p) {
+    if (!arenaFree(p)) free(p);
+}
+
+/// Returns `index` page with at least `end` bytes allocated, only a partially allocated page is ever moved
+static page* reservePage(storage* s, quota* q, size_t index, size_t end) {
+    void** slot = reserveSlot(s, q, index);
+    if (!slot) return NULL;
+
+#ifdef PageCompression
+    if (isPacked(*slot) && !unpackPage(s, q, slot, false)) return NULL;
+#endif
+    if (*slot && !ownPage(s, q, slot, false)) return NULL;
+    page* p = *slot;
+    uint32_t have = p ? p->capacity : 0;
+    if (end <= have) return p;
+
+    size_t capacity = have ? have : MinPageCapacity;
+    while (capacity < end) capacity *= 2;
+
+    if (!charge(q, capacity - have)) return NULL;
+    p = growPage(p, have, capacity);
+    if (!p) {
+        refund(q, capacity - have);
+        errno = ENOSPC;
+        return NULL;
+    }
+    if (!have) {
+        atomic_init(&p->refs, 1);
+        p->entry = NULL;
+    }
+    memset(p->bytes + have, 0, capacity - have);
+    p->capacity = (uint32_t)capacity;
+    s->allocated += capacity - have;
+
+    *slot = p;
+    return p;
+}
+
+/// Frees the pages from `first` up to `end` under `p`, a subtree of `height` starting at page `base`,
+/// along with tables left empty
+/// - Returns: `p`, or `NULL` if it was freed
+static void* prune(storage* s, quota* q, void* p, unsigned height, size_t base, size_t first, size_t end) {
+    if (!p || base + coveredPages(height) <= first || base >= end) return p;
+
+    if (!height) {
+        dropLeaf(s, q, p);
+        return NULL;
+    }
+
+    pageTable* table = p;
+    size_t span = coveredPages(height - 1);
+    bool empty = true;
+    for (size_t i = 0; i < TableSize; ++i) {
+        table->slots[i] = prune(s, q, table->slots[i], height - 1, base + i * span, first, end);
+        if (table->slots[i]) empty = false;
+    }
+    if (!empty) return table;
+
+    refund(q, sizeof(pageTable));
+    free(table);
+    return NULL;
+}
+
+/// Zeroes bytes from `start` up to `end` of the `index` page if it is there, copying it first if it is shared,
+/// within the quota unless `force`d
+/// - Returns: `false` if out of memory or over the quota
+static bool zeroPage(storage* s, quota* q, size_t index, size_t start, size_t end, bool force) {
+    void** slot = findSlot(s, index);
+    if (!slot || !*slot) return true;
+#ifdef PageCompression
+    if (isPacked(*slot) && !unpackPage(s, q, slot, force)) return false;
+#endif
+    page* p = *slot;
+    if (p->capacity <= start) return true;
+    if (!(p = ownPage(s, q, slot, force))) return false;
+    memset(p->bytes + start, 0, (end < p->capacity ? end : p->capacity) - start);
+    return true;
+}
+
+/// Finds the first page from `index` on that is allocated if `data` or a hole otherwise, under `p`
+/// which is a subtree of `height` starting at page `base`, empty subtrees are skipped as a whole
+/// - Returns: page index, `SIZE_MAX` if there is none under `p`
+static size_t findNext(void* p, unsigned height, size_t base, size_t index, bool data) {
+    if (!p) return data ? SIZE_MAX : (index > base ? index : base);
+    if (!height) return data ? base : SIZE_MAX;
+
+    size_t span = coveredPages(height - 1);
+    for (size_t i = index > base ? (index - base) / span : 0; i < TableSize; ++i) {
+        size_t found = findNext(((pageTable*)p)->slots[i], height - 1, base + i * span, index, data);
+        if (found != SIZE_MAX) return found;
+    }
+    return SIZE_MAX;
+}
+
+static _Atomic uint32_t* refsOf(void* p) {
+#ifdef PageCompression
+    if (isPacked(p)) return &asPacked(p)->refs;
+#endif
+    return &((page*)p)->refs;
+}
+
+/// Adds or removes the bytes of leaf `p` to the totals of `s`
+static void countLeaf(storage* s, const void* p, bool add) {
+#ifdef PageCompression
+    if (isPacked(p)) {
+        const packedPage* packed = asPacked(p);
+        s->allocated += add ? packed->length : -(size_t)packed->length;
+        s->packed += add ? packed->capacity : -(size_t)packed->capacity;
+        s->packedLength += add ? packed->length : -(size_t)packed->length;
+        return;
+    }
+#endif
+    s->allocated += add ? ((page*)p)->capacity : -(size_t)((page*)p)->capacity;
+}
+
+/// Lets go of leaf `p` in `s`, it is freed and refunded once no slot points at it
+static void dropLeaf(storage* s, quota* q, void* p) {
+    countLeaf(s, p, false);
+#ifdef PageCompression
+    if (isPacked(p)) {
+        packedPage* packed = asPacked(p);
+        if (atomic_fetch_sub(refsOf(p), 1) != 1) return;
+        refund(q, packed->length);
+        free(packed);
+        return;
+    }
+#endif
+
+    page* leaf = p;
+    if (atomic_load(&leaf->refs) == PinnedRefs) return; // the image holds it
+    bool last;
+    if (leaf->entry) {
+        // the index can hand it out until it is gone from there
+        pthread_mutex_lock(&store.lock);
+        last = atomic_fetch_sub(&leaf->refs, 1) == 1;
+        if (last) unindex(leaf);
+        pthread_mutex_unlock(&store.lock);
+    } else {
+        last = atomic_fetch_sub(&leaf->refs, 1) == 1;
+    }
+    if (!last) return;
+    refund(q, leaf->capacity);
+    freePage(leaf);
+}
+
+/// Makes the raw page in `slot` one that can be written in place: taken out of the index, and copied if
+/// it is shared, within the quota unless `force`d
+/// - Returns: the page, `NULL` if out of memory or over the quota
+static page* ownPage(storage* s, quota* q, void** slot, bool force) {
+    page* p = *slot;
+    // decided where the index cannot hand it out meanwhile, a later drop of another slot only costs a copy
+    bool own;
+    if (p->entry) {
+        pthread_mutex_lock(&store.lock);
+        own = atomic_load(&p->refs) == 1;
+        if (own) unindex(p);
+        pthread_mutex_unlock(&store.lock);
+    } else {
+        own = atomic_load(&p->refs) == 1;
+    }
+    if (own) return p;
+
+    if (force) overcharge(q, p->capacity);
+    else if (!charge(q, p->capacity)) return NULL;
+    page* copy = allocPage(p->capacity);
+    if (!copy) {
+        if (force) abort(); // truncation cannot fail
+        refund(q, p->capacity);
+        errno = ENOSPC;
+        return NULL;
+    }
+    copy->capacity = p->capacity;
+    atomic_init(&copy->refs, 1);
+    copy->entry = NULL;
+    memcpy(copy->bytes, p->bytes, p->capacity);
+
+    dropLeaf(s, q, p);
+    countLeaf(s, copy, true);
+    *slot = copy;
+    return copy;
+}
+
+/// Looks up every full page under `slot`, a subtree of `height`, in the index: pages found there replace
+/// the file's own ones, the rest are added for later files to find
+static void dedupTree(storage* s, quota* q, void** slot, unsigned height) {
+    if (!*slot || isPacked(*slot)) return;
+    if (height) {
+        for (size_t i = 0; i < TableSize; ++i)
+            dedupTree(s, q, &((pageTable*)*slot)->slots[i], height - 1);
+        return;
+    }
+
+    page* p = *slot;
+    if (p->capacity != PageSize || p->entry || atomic_load(&p->refs) > 1) return;
+    uint64_t hash = hashPage(p->bytes);
+
+    pthread_mutex_lock(&store.lock);
+    static uint64_t zeroHash;
+    if (!zeroHash) zeroHash = hashPage(zeroes);
+    if (hash == zeroHash && memcmp(p->bytes, zeroes, PageSize) == 0) {
+        pthread_mutex_unlock(&store.lock);
+        dropLeaf(s, q, p);
+        *slot = NULL; // reads the same as a hole
+        return;
+    }
+
+    storeEntry* e = store.capacity ? store.buckets[hash & (store.capacity - 1)] : NULL;
+    for (; e; e = e->next)
+        if (e->hash == hash && e->owner == q && memcmp(e->page->bytes, p->bytes, PageSize) == 0) break;
+
+    if (e) {
+        page* shared = e->page;
+        atomic_fetch_add(&shared->refs, 1);
+        pthread_mutex_unlock(&store.lock);
+        dropLeaf(s, q, p);
+        countLeaf(s, shared, true);
+        *slot = shared;
+        return;
+    }
+
+    // grows at load factor 1, the page just stays out of the index if anything fails
+    if (store.count >= store.capacity) {
+        size_t capacity = store.capacity ? store.capacity * 2 : 1024;
+        storeEntry** buckets = calloc(capacity, sizeof(storeEntry*));
+        if (buckets) {
+            for (size_t i = 0; i < store.capacity; ++i) {
+                for (storeEntry* next, *old = store.buckets[i]; old; old = next) {
+                    next = old->next;
+                    old->next = buckets[old->hash & (capacity - 1)];
+                    buckets[old->hash & (capacity - 1)] = old;
+                }
+            }
+            free(store.buckets);
+            store.buckets = buckets;
+            store.capacity = capacity;
+        }
+    }
+    if (store.capacity && charge(q, storeEntries.size)) {
+        e = poolAlloc(&storeEntries);
+        if (e) {
+            *e = (storeEntry){ hash, p, q, store.buckets[hash & (store.capacity - 1)] };
+            store.buckets[hash & (store.capacity - 1)] = e;
+            store.count++;
+            p->entry = e;
+        } else {
+            refund(q, storeEntries.size);
+        }
+    }
+    pthread_mutex_unlock(&store.lock);
+}
+
+/// 64 bits mixed from a word at a time, for the index only, contents are compared before sharing
+static uint64_t hashPage(const char* bytes) {
+    uint64_t hash = 0x9E3779B97F4A7C15u;
+    for (size_t i = 0; i < PageSize; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDu;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/// Takes page `p` out of the index, called under its lock
+static void unindex(page* p) {
+    storeEntry* e = p->entry;
+    storeEntry** link = &store.buckets[e->hash & (store.capacity - 1)];
+    while (*link != e) link = &(*link)->next;
+    *link = e->next;
+    store.count--;
+    p->entry = NULL;
+    refund(e->owner, storeEntries.size);
+    poolFree(&storeEntries, e);
+}
+
+#ifdef PageCompression
+/// Packs the pages under `slot`, a subtree of `height`, compressing into `scratch` first
+static void packTree(storage* s, quota* q, void** slot, unsigned height, char* scratch) {
+    if (!*slot || isPacked(*slot)) return;
+    if (height) {
+        for (size_t i = 0; i < TableSize; ++i)
+            packTree(s, q, &((pageTable*)*slot)->slots[i], height - 1, scratch);
+        return;
+    }
+
+    page* p = *slot;
+    // shared pages stay as they are, so that their readers can map them
+    if (p->capacity < MinPackedCapacity || p->entry || atomic_load(&p->refs) > 1) return;
+    int length = LZ4_compress_default(p->bytes, scratch, (int)p->capacity, LZ4_compressBound((int)PageSize));
+    if (length <= 0 || (size_t)length > p->capacity - p->capacity / 4) return;
+
+    packedPage* packed = malloc(sizeof(packedPage) + (size_t)length);
+    if (!packed) return;
+    packed->capacity = p->capacity;
+    atomic_init(&packed->refs, 1);
+    packed->length = (uint32_t)length;
+    memcpy(packed->bytes, scratch, (size_t)length);
+
+    s->allocated -= p->capacity - packed->length;
+    s->packed += packed->capacity;
+    s->packedLength += packed->length;
+    refund(q, p->capacity - packed->length);
+    freePage(p);
+    *slot = tagPacked(packed);
+}
+
+/// Replaces the packed page in `slot` with a raw one, within the quota unless `force`d
+/// - Returns: the raw page, `NULL` if out of memory or over the quota
+static page* unpackPage(storage* s, quota* q, void** slot, bool force) {
+    packedPage* packed = asPacked(*slot);
+    if (force) overcharge(q, packed->capacity);
+    else if (!charge(q, packed->capacity)) return NULL;
+
+    page* p = allocPage(packed->capacity);
+    if (!p) {
+        if (force) abort(); // truncation cannot fail
+        refund(q, packed->capacity);
+        errno = ENOSPC;
+        return NULL;
+    }
+    p->capacity = packed->capacity;
+    atomic_init(&p->refs, 1);
+    p->entry = NULL;
+    LZ4_decompress_safe(packed->bytes, p->bytes, (int)packed->length, (int)packed->capacity);
+
+    dropLeaf(s, q, *slot);
+    countLeaf(s, p, true);
+    *slot = p;
+    return p;
+}
+#endif
@@ -0,0 +1,89 @@
+#ifndef storage_h
+#define storage_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "Quota.h"
+
+/// 64 KiB by default, `-DPageShift=20` makes a whole 1 MiB request a single page copy
+#ifndef PageShift
+#define PageShift 16
+#endif
+#define PageSize ((size_t)1 << PageShift)
+_Static_assert(PageShift >= 12 && PageShift < 32, "page capacity is 32 bit");
+#define MinPageCapacity 64
+
+/// Most `storageMap` segments `size` bytes can take: the written part and a zero tail of every page touched
+#define storageMapCapacity(size) (2 * (((size) >> PageShift) + 2))
+
+struct storeEntry;
+
+/// One page of file contents, small files only get as much of it as they use.
+/// Pages may be shared by several files, or several places in one, and are copied before a write then
+typedef struct page {
+    uint32_t capacity; /// allocated bytes, a power of two up to `PageSize`, unwritten ones are zero
+    _Atomic uint32_t refs; /// slots pointing at it, `PinnedRefs` for a page of a loaded image
+    struct storeEntry* entry; /// in the index of contents after `storageDedup`, `NULL` otherwise
+    char bytes[];
+} page;
+
+/// Pages of an image mapped by `loadImage` are never written, counted or freed, writes go to a copy
+#define PinnedRefs UINT32_MAX
+
+#ifdef PageCompression
+/// LZ4 image of a page of a cold file, only kept if it saves a quarter at least
+typedef struct packedPage {
+    uint32_t capacity; /// of the page it replaces
+    _Atomic uint32_t refs; /// same as in `page`
+    uint32_t length; /// of the compressed `bytes`
+    char bytes[];
+} packedPage;
+#endif
+
+/// Radix tree levels resolve 9 bits of the page index each, at most 6 of them cover any `off_t` offset
+#define TableShift 9
+#define TableSize ((size_t)1 << TableShift)
+
+/// Inner node of the page tree, slots of the lowest tables point at pages, the rest at tables
+typedef struct pageTable {
+    void* slots[TableSize]; /// `NULL` subtrees read as zeros
+} pageTable;
+
+/// Contents of a regular file as a radix tree of pages, allocated on first write.
+/// Lookups take `height` steps whatever the size, and holes cost nothing
+typedef struct storage {
+    void* root; /// the first and only page while `height` is `0`, a `pageTable` above
+    unsigned height; /// levels of tables, the tree covers `TableSize^height` pages
+    size_t allocated; /// bytes of all the pages, for `st_blocks`, packed ones count as compressed
+#ifdef PageCompression
+    size_t packed; /// capacity of the packed pages
+    size_t packedLength; /// what they take compressed
+#endif
+} storage;
+
+void storageRead(storage* s, char* buf, size_t size, off_t offset);
+void storageExport(storage* s, char* buf, size_t size, off_t offset, char* scratch);
+size_t storageMap(storage* s, struct iovec* vec, size_t size, off_t offset);
+bool storageWrite(storage* s, quota* q, const char* buf, size_t size, off_t offset);
+bool storageReserve(storage* s, quota* q, size_t size, off_t offset);
+void storageTruncate(storage* s, quota* q, off_t size);
+void storagePunch(storage* s, quota* q, size_t size, off_t offset);
+bool storageCopy(storage* s, quota* q, storage* from, size_t size, off_t fromOffset, off_t offset);
+off_t storageSeek(storage* s, off_t offset, int whence, off_t size);
+void storageRelease(storage* s, quota* q);
+void storageDedup(storage* s, quota* q);
+bool storageClone(storage* s, quota* q, storage* from, size_t count, size_t fromPage, size_t toPage);
+const char* storageNext(storage* s, size_t* index, size_t* capacity, char* scratch);
+bool storageAdopt(storage* s, quota* q, size_t index, page* p);
+
+#ifdef PageCompression
+void storagePack(storage* s, quota* q);
+bool storagePacked(storage* s, size_t size, off_t offset);
+bool storageUnpack(storage* s, quota* q, size_t size, off_t offset);
+#endif
+
+#endif /* storage_h */
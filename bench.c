@@ -0,0 +1,520 @@
+/// Microbenchmarks of the core, without FUSE in the way:
+/// - lookup throughput against the number of reader threads, while a writer keeps creating and removing
+///   directories next to the paths being looked up, and checks that the cache never keeps a stale outcome
+///   of the lookups readers make of those directories
+/// - create, lookup, stat, rename and unlink throughput against the number of entries in a directory
+///   and its depth, and how long releasing such a tree takes
+/// - write, read and copy bandwidth of `writeNode`, `readNode` and `copyNode`, what `write` and `read`
+///   end up in, against the size of the requests and of the file
+/// - `SEEK_DATA` and `SEEK_HOLE` through the extents of sparse files of those sizes
+/// - files sharing identical pages, deduplicated, overwritten and unlinked from several threads at once,
+///   checking that a write to one never shows up in another
+/// Prints one JSON object per line, usage: `./bench [seconds per run] [max threads] [max entries]`
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "Filesystem.h"
+
+#define NDirs 64
+#define NFiles 64
+#define NPaths (NDirs * NFiles)
+#define MaxDepth 64
+#define NChurned (NDirs * 8)
+#define DedupPages 16
+
+enum { OpCreate, OpLookup, OpStat, OpRename, OpUnlink, NOps };
+static const char* opNames[NOps] = { "create", "lookup", "stat", "rename", "unlink" };
+
+static Filesystem* fs;
+static char paths[NPaths][32];
+static atomic_bool running;
+static int status; /// of the process, `1` once a check failed
+
+typedef struct {
+    unsigned seed;
+    uint64_t ops;
+    uint64_t misses;
+} reader;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// - Returns: `false` if `path` could not be created
+static bool makeNode(const char* path, mode_t mode) {
+    inode* node = newNode(fs, mode, 0, 0);
+    if (!node) return false;
+    writeLock(fs);
+    bool linked = addNode(path, fs, node) != NULL;
+    unlock(fs);
+    if (!linked) dropNode(node);
+    return linked;
+}
+
+static void churnedPath(char* path, size_t size, int i) {
+    snprintf(path, size, "/d%d/churn%d", i % NDirs, i / NDirs);
+}
+
+/// Every path is looked up with the cache in front, half of the time bypassing it, and every
+/// fourth lookup is of a directory the writer is churning, which may or may not be there
+static void* readLoop(void* arg) {
+    reader* r = arg;
+    char churned[32];
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        for (int i = 0; i < 1024; ++i) {
+            if (i % 4 == 3) {
+                churnedPath(churned, sizeof(churned), rand_r(&r->seed) % NChurned);
+                enterEpoch();
+                lookupNode(churned, fs);
+                exitEpoch();
+                continue;
+            }
+            const char* path = paths[rand_r(&r->seed) % NPaths];
+            enterEpoch();
+            inode* node = (i & 1) ? lookupNode(path, fs) : pathfind(path, fs->root);
+            exitEpoch();
+            if (!node) r->misses++;
+        }
+        r->ops += 1024;
+    }
+    return NULL;
+}
+
+/// Tells whether a lookup through the cache agrees with the tree, which only the writer changes
+static bool lookupAgrees(const char* path, bool linked) {
+    enterEpoch();
+    bool found = lookupNode(path, fs) != NULL;
+    exitEpoch();
+    return found == linked;
+}
+
+typedef struct {
+    unsigned seed;
+    uint64_t ops;
+    uint64_t stale; /// lookups that disagreed with the tree, a race left an outdated entry in the cache
+    bool linked[NChurned];
+} writer;
+
+/// Directory churn in the same parents, so that readers race with index growth and reclamation. After each
+/// change that path and another one are looked up, the outcome of a racing reader can stay in the cache for long
+static void* writeLoop(void* arg) {
+    writer* w = arg;
+    char path[32];
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        int i = (int)(w->ops % NChurned);
+        churnedPath(path, sizeof(path), i);
+        if (!w->linked[i]) {
+            w->linked[i] = makeNode(path, S_IFDIR | 0755);
+        } else {
+            writeLock(fs);
+            w->linked[i] = !releaseNode(path, fs);
+            unlock(fs);
+        }
+        if (!lookupAgrees(path, w->linked[i])) w->stale++;
+
+        int other = rand_r(&w->seed) % NChurned;
+        churnedPath(path, sizeof(path), other);
+        if (!lookupAgrees(path, w->linked[other])) w->stale++;
+        w->ops++;
+    }
+
+    // the next run starts from the same tree
+    writeLock(fs);
+    for (int i = 0; i < NChurned; ++i) {
+        churnedPath(path, sizeof(path), i);
+        if (w->linked[i]) releaseNode(path, fs);
+    }
+    unlock(fs);
+    return NULL;
+}
+
+static void run(int threads, double seconds) {
+    pthread_t ids[threads], writerId;
+    reader readers[threads];
+    writer* w = calloc(1, sizeof(writer));
+    w->seed = 1;
+
+    atomic_store(&running, true);
+    pthread_create(&writerId, NULL, writeLoop, w);
+    double start = now();
+    for (int i = 0; i < threads; ++i) {
+        readers[i] = (reader){ .seed = (unsigned)i + 1 };
+        pthread_create(&ids[i], NULL, readLoop, &readers[i]);
+    }
+
+    struct timespec duration = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    nanosleep(&duration, NULL);
+    atomic_store(&running, false);
+
+    uint64_t ops = 0, misses = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(ids[i], NULL);
+        ops += readers[i].ops;
+        misses += readers[i].misses;
+    }
+    double elapsed = now() - start;
+    pthread_join(writerId, NULL);
+
+    printf("{\"bench\":\"lookup\",\"threads\":%d,\"seconds\":%.3f,\"ops\":%llu,\"misses\":%llu,"
+           "\"writes\":%llu,\"stale\":%llu,\"ops_per_sec\":%.0f}\n",
+           threads, elapsed, (unsigned long long)ops, (unsigned long long)misses,
+           (unsigned long long)w->ops, (unsigned long long)w->stale, ops / elapsed);
+    if (w->stale) {
+        fprintf(stderr, "The cache of paths kept %llu stale lookups\n", (unsigned long long)w->stale);
+        status = 1;
+    }
+    free(w);
+    fflush(stdout);
+}
+
+/// Every operation goes once over `fanout` files in a directory `depth` levels down, in rounds until `seconds` pass
+static void metaRun(int fanout, int depth, double seconds) {
+    fs = newFilesystem(0, 0);
+    char dir[MaxDepth * 8] = "";
+    for (int d = 0, n = 0; d < depth; ++d) {
+        n += snprintf(dir + n, sizeof(dir) - n, "/l%d", d);
+        makeNode(dir, S_IFDIR | 0755);
+    }
+
+    // formatting stays out of the measurement, lookups go in random order
+    size_t stride = strlen(dir) + 16;
+    char* paths = malloc((size_t)fanout * stride);
+    char* renamed = malloc((size_t)fanout * stride);
+    int* order = malloc((size_t)fanout * sizeof(int));
+    unsigned seed = 1;
+    for (int i = 0; i < fanout; ++i) {
+        snprintf(paths + (size_t)i * stride, stride, "%s/f%d", dir, i);
+        snprintf(renamed + (size_t)i * stride, stride, "%s/r%d", dir, i);
+        order[i] = i;
+    }
+    for (int i = fanout - 1; i > 0; --i) {
+        int k = rand_r(&seed) % (i + 1), t = order[i];
+        order[i] = order[k];
+        order[k] = t;
+    }
+
+    double spent[NOps] = { 0 }, total = 0;
+    uint64_t rounds = 0, misses = 0;
+    do {
+        double start = now();
+        for (int i = 0; i < fanout; ++i)
+            makeNode(paths + (size_t)i * stride, S_IFREG | 0644);
+        double lap = now();
+        spent[OpCreate] += lap - start;
+
+        start = lap;
+        for (int i = 0; i < fanout; ++i) {
+            enterEpoch();
+            if (!pathfind(paths + (size_t)order[i] * stride, fs->root)) misses++;
+            exitEpoch();
+        }
+        lap = now();
+        spent[OpLookup] += lap - start;
+
+        // what `getattr` does, through the cache of paths
+        start = lap;
+        for (int i = 0; i < fanout; ++i) {
+            struct stat st;
+            enterEpoch();
+            inode* node = lookupNode(paths + (size_t)order[i] * stride, fs);
+            if (node) statNode(node, &st);
+            else misses++;
+            exitEpoch();
+        }
+        lap = now();
+        spent[OpStat] += lap - start;
+
+        start = lap;
+        for (int i = 0; i < fanout; ++i) {
+            writeLock(fs);
+            if (!moveNode(paths + (size_t)i * stride, renamed + (size_t)i * stride, fs)) misses++;
+            unlock(fs);
+        }
+        lap = now();
+        spent[OpRename] += lap - start;
+
+        start = lap;
+        for (int i = 0; i < fanout; ++i) {
+            writeLock(fs);
+            if (!releaseNode(renamed + (size_t)i * stride, fs)) misses++;
+            unlock(fs);
+        }
+        lap = now();
+        spent[OpUnlink] += lap - start;
+
+        total = 0;
+        for (int op = 0; op < NOps; ++op) total += spent[op];
+        rounds++;
+    } while (total < seconds);
+
+    for (int op = 0; op < NOps; ++op) {
+        uint64_t ops = rounds * (uint64_t)fanout;
+        printf("{\"bench\":\"meta\",\"op\":\"%s\",\"fanout\":%d,\"depth\":%d,\"seconds\":%.3f,\"ops\":%llu,"
+               "\"misses\":%llu,\"ops_per_sec\":%.0f}\n",
+               opNames[op], fanout, depth, spent[op], (unsigned long long)ops, (unsigned long long)misses,
+               ops / spent[op]);
+    }
+
+    // `releaseAll` of the whole tree at unmount
+    for (int i = 0; i < fanout; ++i)
+        makeNode(paths + (size_t)i * stride, S_IFREG | 0644);
+    double start = now();
+    releaseFilesystem(fs);
+    double elapsed = now() - start;
+    printf("{\"bench\":\"meta\",\"op\":\"release\",\"fanout\":%d,\"depth\":%d,\"seconds\":%.3f,\"ops\":%d,"
+           "\"ops_per_sec\":%.0f}\n",
+           fanout, depth, elapsed, fanout + depth, (fanout + depth) / elapsed);
+    fflush(stdout);
+
+    free(paths);
+    free(renamed);
+    free(order);
+}
+
+/// Whole file passes of `ioSize` requests: writes into a new file, so every page gets allocated,
+/// overwrites of the pages in place, reads, and copies into another file, which share the pages of
+/// page aligned requests. Each one is repeated until a quarter of `seconds` passes
+static void ioRun(size_t fileSize, size_t ioSize, double seconds) {
+    fs = newFilesystem(0, 0);
+    makeNode("/io", S_IFREG | 0644);
+    makeNode("/copy", S_IFREG | 0644);
+    enterEpoch();
+    inode* node = lookupNode("/io", fs);
+    inode* copy = lookupNode("/copy", fs);
+    exitEpoch();
+
+    char* buf = malloc(ioSize);
+    for (size_t i = 0; i < ioSize; ++i) buf[i] = (char)(i * 31 + 7);
+
+    static const char* names[] = { "write", "overwrite", "read", "copy" };
+    for (int op = 0; op < 4; ++op) {
+        uint64_t bytes = 0;
+        double start = now(), elapsed;
+        do {
+            inode* target = op == 3 ? copy : node;
+            if (op == 0 || op == 3) {
+                writeLock(target);
+                truncateNode(target, 0);
+                unlock(target);
+            }
+            for (size_t offset = 0; offset < fileSize; offset += ioSize) {
+                if (op == 3) {
+                    lockPair(copy, node);
+                    copyNode(copy, (off_t)offset, node, (off_t)offset, ioSize);
+                    unlockPair(copy, node);
+                    continue;
+                }
+                if (op < 2) {
+                    writeLock(node);
+                    writeNode(node, buf, ioSize, (off_t)offset);
+                } else {
+                    lockRange(node, ioSize, (off_t)offset);
+                    readNode(node, buf, ioSize, (off_t)offset);
+                }
+                unlock(node);
+            }
+            bytes += fileSize;
+            elapsed = now() - start;
+        } while (elapsed < seconds / 4);
+
+        printf("{\"bench\":\"io\",\"op\":\"%s\",\"file_size\":%zu,\"io_size\":%zu,\"seconds\":%.3f,"
+               "\"bytes\":%llu,\"mb_per_sec\":%.1f}\n",
+               names[op], fileSize, ioSize, elapsed, (unsigned long long)bytes, bytes / elapsed / (1 << 20));
+    }
+    fflush(stdout);
+
+    free(buf);
+    releaseFilesystem(fs);
+}
+
+/// `SEEK_DATA` and `SEEK_HOLE` over a file of `fileSize` bytes with data in every other page, through
+/// every extent and back to the start until `seconds` pass, checking that each one is found
+static void seekRun(size_t fileSize, double seconds) {
+    fs = newFilesystem(0, 0);
+    makeNode("/sparse", S_IFREG | 0644);
+    enterEpoch();
+    inode* node = lookupNode("/sparse", fs);
+    exitEpoch();
+
+    char* buf = malloc(PageSize);
+    memset(buf, 'x', PageSize);
+    writeLock(node);
+    for (size_t offset = 0; offset < fileSize; offset += 2 * PageSize)
+        writeNode(node, buf, PageSize, (off_t)offset);
+    truncateNode(node, (off_t)fileSize);
+    unlock(node);
+    free(buf);
+
+    uint64_t seeks = 0, extents = 0, expected = 0, rounds = 0;
+    double start = now(), elapsed;
+    do {
+        readLock(node);
+        for (off_t offset = 0; (offset = seekNode(node, offset, SEEK_DATA)) >= 0; ++extents) {
+            offset = seekNode(node, offset, SEEK_HOLE);
+            seeks += 2;
+        }
+        unlock(node);
+        expected += (fileSize + 2 * PageSize - 1) / (2 * PageSize);
+        rounds++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    printf("{\"bench\":\"seek\",\"file_size\":%zu,\"seconds\":%.3f,\"extents\":%llu,\"seeks\":%llu,"
+           "\"seeks_per_sec\":%.0f}\n",
+           fileSize, elapsed, (unsigned long long)(extents / rounds), (unsigned long long)seeks, seeks / elapsed);
+    fflush(stdout);
+    if (extents != expected) {
+        fprintf(stderr, "Found %llu data extents instead of %llu\n", (unsigned long long)extents,
+                (unsigned long long)expected);
+        status = 1;
+    }
+    releaseFilesystem(fs);
+}
+
+typedef struct {
+    int id;
+    uint64_t ops;
+    uint64_t corrupt; /// rounds that read back something else than written
+} deduper;
+
+/// Page `k` of every file has the same contents, but the one a thread overwrites gets its own
+static void fillPage(char* buf, size_t k, int owner) {
+    memset(buf, owner < 0 ? (int)(k + 1) : 0x80 | owner, PageSize);
+}
+
+/// Rounds of writing a file of pages other threads' files have too, sharing them, overwriting one in place
+/// and reading the file back, then unlinking it
+static void* dedupLoop(void* arg) {
+    deduper* d = arg;
+    char path[32];
+    snprintf(path, sizeof(path), "/dedup%d", d->id);
+    char* buf = malloc(PageSize);
+    char* file = malloc(DedupPages * PageSize);
+    char* expected = malloc(DedupPages * PageSize);
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (!makeNode(path, S_IFREG | 0644)) break;
+        enterEpoch();
+        inode* node = lookupNode(path, fs); // only this thread unlinks it
+        exitEpoch();
+
+        writeLock(node);
+        for (size_t k = 0; k < DedupPages; ++k) {
+            fillPage(buf, k, -1);
+            writeNode(node, buf, PageSize, (off_t)(k * PageSize));
+            memcpy(expected + k * PageSize, buf, PageSize);
+        }
+        dedupNode(node);
+        unlock(node);
+
+        size_t k = d->ops % DedupPages;
+        fillPage(buf, k, d->id);
+        memcpy(expected + k * PageSize, buf, PageSize);
+        writeLock(node);
+        writeNode(node, buf, PageSize, (off_t)(k * PageSize));
+        unlock(node);
+
+        lockRange(node, DedupPages * PageSize, 0);
+        readNode(node, file, DedupPages * PageSize, 0);
+        unlock(node);
+        if (memcmp(file, expected, DedupPages * PageSize) != 0) d->corrupt++;
+
+        writeLock(fs);
+        releaseNode(path, fs);
+        unlock(fs);
+        d->ops++;
+    }
+    free(buf);
+    free(file);
+    free(expected);
+    return NULL;
+}
+
+static void dedupRun(int threads, double seconds) {
+    fs = newFilesystem(0, 0);
+    pthread_t ids[threads];
+    deduper dedupers[threads];
+
+    atomic_store(&running, true);
+    double start = now();
+    for (int i = 0; i < threads; ++i) {
+        dedupers[i] = (deduper){ .id = i };
+        pthread_create(&ids[i], NULL, dedupLoop, &dedupers[i]);
+    }
+    struct timespec duration = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    nanosleep(&duration, NULL);
+    atomic_store(&running, false);
+
+    uint64_t ops = 0, corrupt = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(ids[i], NULL);
+        ops += dedupers[i].ops;
+        corrupt += dedupers[i].corrupt;
+    }
+    double elapsed = now() - start;
+
+    printf("{\"bench\":\"dedup\",\"threads\":%d,\"seconds\":%.3f,\"rounds\":%llu,\"corrupt\":%llu,"
+           "\"rounds_per_sec\":%.0f}\n",
+           threads, elapsed, (unsigned long long)ops, (unsigned long long)corrupt, ops / elapsed);
+    fflush(stdout);
+    if (corrupt) {
+        fprintf(stderr, "Files sharing pages read back %llu times what another one wrote\n",
+                (unsigned long long)corrupt);
+        status = 1;
+    }
+    releaseFilesystem(fs);
+}
+
+static void lookupSuite(double seconds, int maxThreads) {
+    fs = newFilesystem(0, 0);
+    for (int d = 0; d < NDirs; ++d) {
+        char dir[16];
+        snprintf(dir, sizeof(dir), "/d%d", d);
+        makeNode(dir, S_IFDIR | 0755);
+        for (int f = 0; f < NFiles; ++f) {
+            snprintf(paths[d * NFiles + f], sizeof(paths[0]), "%s/f%d", dir, f);
+            makeNode(paths[d * NFiles + f], S_IFREG | 0644);
+        }
+    }
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        run(threads, seconds);
+
+    releaseFilesystem(fs);
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    int maxThreads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int maxFanout = argc > 3 ? atoi(argv[3]) : 1000000;
+    if (seconds <= 0 || maxThreads < 1 || maxFanout < 10) {
+        fprintf(stderr, "usage: %s [seconds per run] [max threads] [max entries]\n", argv[0]);
+        return 1;
+    }
+
+    lookupSuite(seconds, maxThreads);
+
+    for (int fanout = 10; fanout <= maxFanout; fanout *= 10)
+        metaRun(fanout, 1, seconds);
+    for (int depth = 4; depth <= MaxDepth; depth *= 4)
+        metaRun(1000 < maxFanout ? 1000 : maxFanout, depth, seconds);
+
+    static const size_t fileSizes[] = { (size_t)64 << 10, (size_t)1 << 20, (size_t)16 << 20, (size_t)256 << 20 };
+    static const size_t ioSizes[] = { (size_t)4 << 10, (size_t)64 << 10, (size_t)1 << 20 };
+    for (size_t f = 0; f < sizeof(fileSizes) / sizeof(fileSizes[0]); ++f)
+        for (size_t i = 0; i < sizeof(ioSizes) / sizeof(ioSizes[0]) && ioSizes[i] <= fileSizes[f]; ++i)
+            ioRun(fileSizes[f], ioSizes[i], seconds);
+    for (size_t f = 0; f < sizeof(fileSizes) / sizeof(fileSizes[0]); ++f)
+        seekRun(fileSizes[f], seconds);
+    for (int threads = 2; threads <= (maxThreads > 2 ? maxThreads : 2); threads *= 2)
+        dedupRun(threads, seconds);
+    return status;
+}
@@ -0,0 +1,605 @@
+#define FUSE_USE_VERSION 26
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "Filesystem.h"
+#include "Options.h"
+#include "Image.h"
+#include "Journal.h"
+
+/// Every change goes through this process and is invalidated explicitly, so the kernel may cache for long
+#define CacheTimeout 3600.0
+
+/// Kernel cache timeouts in seconds, same mount options as in the high-level API
+typedef struct {
+    double attr;
+    double entry;
+    double negative;
+} cacheTimeouts;
+
+static cacheTimeouts timeouts = { CacheTimeout, CacheTimeout, CacheTimeout };
+static options opts;
+
+static const struct fuse_opt timeoutOptions[] = {
+    { "attr_timeout=%lf", offsetof(cacheTimeouts, attr), 0 },
+    { "entry_timeout=%lf", offsetof(cacheTimeouts, entry), 0 },
+    { "negative_timeout=%lf", offsetof(cacheTimeouts, negative), 0 },
+    FUSE_OPT_END
+};
+
+/// Kernel cache invalidation, queued and sent from a thread of its own:
+/// the kernel may hold locks until the request that caused it is answered
+typedef struct notice {
+    fuse_ino_t ino; /// the inode, or parent of `name`
+    off_t offset; /// start of the data to drop, negative for attributes only
+    struct notice* next;
+    char name[]; /// entry to drop, empty for the inode itself
+} notice;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    notice* first;
+    notice* last;
+    struct fuse_chan* channel; /// `NULL` until the session runs
+    bool stopping;
+    pthread_t thread;
+} notifier = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+/// Inode numbers handed to the kernel are the ones of the `inodeTable`, the root is `FUSE_ROOT_ID` there too
+static inode* toNode(fuse_req_t req, fuse_ino_t ino) {
+    return numberedNode(fuse_req_userdata(req), ino);
+}
+
+/// Fills in `e` for `node`
+static void fillEntry(inode* node, struct fuse_entry_param* e) {
+    *e = (struct fuse_entry_param){
+        .ino = node->ino,
+        .generation = node->generation,
+        .attr_timeout = timeouts.attr,
+        .entry_timeout = timeouts.entry
+    };
+    readLock(node);
+    statNode(node, &e->attr);
+    unlock(node);
+}
+
+/// Replies with the entry for `node`, which counts as a lookup until the kernel forgets it
+static void replyEntry(fuse_req_t req, inode* node) {
+    struct fuse_entry_param e;
+    fillEntry(node, &e);
+
+    if (!pinNode(node)) {
+        fuse_reply_err(req, errno); // lost a race with the last unlink
+        return;
+    }
+    if (fuse_reply_entry(req, &e) != 0) {
+        // request was interrupted, the kernel will not send forget for it
+        forgetNode(node, 1);
+    }
+}
+
+/// Points `bufv` at `count` memory segments of `vec`
+static void fillBufvec(struct fuse_bufvec* bufv, const struct iovec* vec, size_t count) {
+    *bufv = (struct fuse_bufvec){ .count = count };
+    for (size_t i = 0; i < count; ++i)
+        bufv->buf[i] = (struct fuse_buf){ .size = vec[i].iov_len, .mem = vec[i].iov_base, .fd = -1 };
+}
+
+/// Queues invalidation of the `name` entry in the `ino` directory, or of the inode itself from `offset` if `name` is `NULL`
+static void notify(fuse_ino_t ino, const char* name, off_t offset) {
+    if (!notifier.channel) return;
+
+    size_t n = name ? strlen(name) : 0;
+    notice* item = malloc(sizeof(notice) + n + 1);
+    if (!item) return; // the timeouts still bound how stale the kernel gets
+    item->ino = ino;
+    item->offset = offset;
+    item->next = NULL;
+    memcpy(item->name, name ? name : "", n + 1);
+
+    pthread_mutex_lock(&notifier.lock);
+    if (notifier.last) notifier.last->next = item;
+    else notifier.first = item;
+    notifier.last = item;
+    pthread_cond_signal(&notifier.wake);
+    pthread_mutex_unlock(&notifier.lock);
+}
+
+static void* notifyLoop(void* arg) {
+    pthread_mutex_lock(&notifier.lock);
+    while (!notifier.stopping || notifier.first) {
+        notice* item = notifier.first;
+        if (!item) {
+            pthread_cond_wait(&notifier.wake, &notifier.lock);
+            continue;
+        }
+        notifier.first = item->next;
+        if (!notifier.first) notifier.last = NULL;
+        pthread_mutex_unlock(&notifier.lock);
+
+        // failures only mean the kernel did not have it cached
+        if (*item->name) fuse_lowlevel_notify_inval_entry(notifier.channel, item->ino, item->name, strlen(item->name));
+        else fuse_lowlevel_notify_inval_inode(notifier.channel, item->ino, item->offset, 0);
+        free(item);
+
+        pthread_mutex_lock(&notifier.lock);
+    }
+    pthread_mutex_unlock(&notifier.lock);
+    return NULL;
+}
+
+/// Starts sending invalidations over `ch`
+/// - Returns: `false` if the thread could not be created, the kernel caches only expire then
+static bool startNotifier(struct fuse_chan* ch) {
+    notifier.channel = ch;
+    notifier.stopping = false;
+    if (pthread_create(&notifier.thread, NULL, notifyLoop, NULL) == 0) return true;
+    notifier.channel = NULL;
+    return false;
+}
+
+/// Sends whatever is queued and stops the thread
+static void stopNotifier(void) {
+    if (!notifier.channel) return;
+    pthread_mutex_lock(&notifier.lock);
+    notifier.stopping = true;
+    pthread_cond_signal(&notifier.wake);
+    pthread_mutex_unlock(&notifier.lock);
+    pthread_join(notifier.thread, NULL);
+    notifier.channel = NULL;
+}
+
+/// Allocates a new inode owned by the caller of `req`
+static inode* newOwnedNode(fuse_req_t req, mode_t mode) {
+    const struct fuse_ctx* ctx = fuse_req_ctx(req);
+    return newNode(fuse_req_userdata(req), mode, ctx->uid, ctx->gid);
+}
+
+/// Look up a directory entry by name and get its attributes
+void ramLookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    inode* dirNode = toNode(req, parent);
+    if (!isDir(dirNode)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    enterEpoch();
+    directory* dir = asDir(dirNode);
+    entry* p = dir ? findEntry(dir, name, strlen(name)) : NULL;
+    if (p) replyEntry(req, p->node);
+    else if (timeouts.negative > 0) {
+        // the kernel remembers that there is no such name until one is created through it
+        struct fuse_entry_param e = { .ino = 0, .entry_timeout = timeouts.negative };
+        fuse_reply_entry(req, &e);
+    }
+    else fuse_reply_err(req, ENOENT);
+    exitEpoch();
+}
+
+/** Forget about an inode
+ The nlookup parameter indicates the number of lookups
+ previously performed on this inode.
+*/
+void ramForget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    forgetNode(toNode(req, ino), nlookup);
+    fuse_reply_none(req);
+}
+
+/// Get file attributes
+void ramGetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    inode* node = toNode(req, ino);
+    struct stat statbuf = {0};
+    readLock(node);
+    statNode(node, &statbuf);
+    unlock(node);
+    statbuf.st_ino = ino;
+    fuse_reply_attr(req, &statbuf, timeouts.attr);
+}
+
+/// Set file attributes, `truncate` comes here with `FUSE_SET_ATTR_SIZE`
+void ramSetattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    inode* node = toNode(req, ino);
+    if ((to_set & FUSE_SET_ATTR_SIZE) && isDir(node)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    writeLock(node);
+    bool ok = !(to_set & FUSE_SET_ATTR_SIZE) || truncateNode(node, attr->st_size);
+    if (ok) {
+        if (to_set & FUSE_SET_ATTR_MODE) node->mode = (node->mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+        if (to_set & FUSE_SET_ATTR_UID) node->uid = attr->st_uid;
+        if (to_set & FUSE_SET_ATTR_GID) node->gid = attr->st_gid;
+        if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) journalAttributes(node);
+    }
+    unlock(node);
+
+    if (!ok) fuse_reply_err(req, errno);
+    else ramGetattr(req, ino, fi);
+    if (ok && (to_set & FUSE_SET_ATTR_SIZE)) notify(ino, NULL, 0);
+}
+
+/// Create a file node
+void ramMknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    Filesystem* fs = fuse_req_userdata(req);
+    inode* node = newOwnedNode(req, mode | S_IFREG);
+    if (!node) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    writeLock(fs);
+    if (linkNode(toNode(req, parent), name, node)) replyEntry(req, node);
+    else {
+        fuse_reply_err(req, errno);
+        dropNode(node);
+    }
+    unlock(fs);
+}
+
+/// Create a directory
+void ramMkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    Filesystem* fs = fuse_req_userdata(req);
+    inode* node = newOwnedNode(req, mode | S_IFDIR);
+    if (!node) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    writeLock(fs);
+    if (linkNode(toNode(req, parent), name, node)) replyEntry(req, node);
+    else {
+        fuse_reply_err(req, errno);
+        dropNode(node);
+    }
+    unlock(fs);
+}
+
+/// Removes `name` from `parent` if it is a directory exactly when `dir` is set
+/// - Returns: `0` or error number
+static int removeName(fuse_req_t req, fuse_ino_t parent, const char *name, bool dir) {
+    Filesystem* fs = fuse_req_userdata(req);
+    inode* dirNode = toNode(req, parent);
+
+    writeLock(fs);
+    entry* p = dirNode->data ? findEntry(asDir(dirNode), name, strlen(name)) : NULL;
+    int err = p ? 0 : ENOENT;
+    if (p && isDir(p->node) != dir) err = dir ? ENOTDIR : EISDIR;
+    else if (p && !unlinkNode(dirNode, name)) err = errno;
+    unlock(fs);
+
+    return err;
+}
+
+/// Remove a file, it stays alive while open or known to the kernel
+void ramUnlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    int err = removeName(req, parent, name, false);
+    fuse_reply_err(req, err);
+    if (!err) notify(parent, name, 0);
+}
+
+/// Remove a directory
+void ramRmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    int err = removeName(req, parent, name, true);
+    fuse_reply_err(req, err);
+    if (!err) notify(parent, name, 0);
+}
+
+/// Rename a file
+void ramRename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    Filesystem* fs = fuse_req_userdata(req);
+    inode* dirNode = toNode(req, parent);
+    inode* newDirNode = toNode(req, newparent);
+
+    writeLock(fs);
+    int err = ENOENT;
+    if (dirNode->data && newDirNode->data) err = relinkNode(dirNode, name, newDirNode, newname) ? 0 : errno;
+    unlock(fs);
+
+    fuse_reply_err(req, err);
+    if (!err) {
+        notify(parent, name, 0);
+        notify(newparent, newname, 0);
+    }
+}
+
+/// Create a hard link to a file
+void ramLink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    Filesystem* fs = fuse_req_userdata(req);
+    inode* node = toNode(req, ino);
+    inode* dirNode = toNode(req, newparent);
+    if (isDir(node)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    writeLock(fs);
+    if (linkNode(dirNode, newname, node)) replyEntry(req, node);
+    else fuse_reply_err(req, errno);
+    unlock(fs);
+}
+
+/// File open operation
+void ramOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    inode* node = toNode(req, ino);
+    if (isDir(node)) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    if (!openNode(node)) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    fi->fh = (uint64_t)node;
+    writeLock(node);
+    fi->keep_cache = keepCache(node);
+    unlock(node);
+    if (fuse_reply_open(req, fi) != 0) closeNode(node);
+}
+
+/// Read data from an open file
+void ramRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    inode* node = (inode*)fi->fh;
+
+    size_t capacity = storageMapCapacity(size);
+    struct iovec* vec = malloc(capacity * sizeof(struct iovec));
+    struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec) + capacity * sizeof(struct fuse_buf));
+    if (!vec || !bufv) {
+        fuse_reply_err(req, ENOMEM);
+        free(vec);
+        free(bufv);
+        return;
+    }
+
+    // the pages go to the kernel as they are, so they have to stay put until the reply is sent
+    if (!lockRange(node, size, offset)) {
+        fuse_reply_err(req, errno);
+        free(vec);
+        free(bufv);
+        return;
+    }
+    fillBufvec(bufv, vec, mapNode(node, vec, size, offset));
+    fuse_reply_data(req, bufv, 0);
+    unlock(node);
+
+    free(vec);
+    free(bufv);
+}
+
+/// Write data to an open file, copied from the request or the splice pipe straight into the pages
+void ramWriteBuf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
+    inode* node = (inode*)fi->fh;
+    size_t size = fuse_buf_size(bufv);
+
+    size_t capacity = storageMapCapacity(size);
+    struct iovec* vec = malloc(capacity * sizeof(struct iovec));
+    struct fuse_bufvec* dst = malloc(sizeof(struct fuse_bufvec) + capacity * sizeof(struct fuse_buf));
+    if (!vec || !dst) {
+        fuse_reply_err(req, ENOMEM);
+        free(vec);
+        free(dst);
+        return;
+    }
+
+    writeLock(node);
+    off_t before = node->size;
+    ssize_t count = reserveNode(node, vec, size, offset);
+    ssize_t written = count < 0 ? -errno : 0;
+    if (count > 0) {
+        fillBufvec(dst, vec, (size_t)count);
+        written = fuse_buf_copy(dst, bufv, 0);
+    }
+    if (count >= 0) commitNode(node, size, written < 0 ? 0 : (size_t)written, offset);
+    bool grown = node->size > before;
+    unlock(node);
+
+    if (written < 0) fuse_reply_err(req, (int)-written);
+    else fuse_reply_write(req, (size_t)written);
+    // the kernel drops the attributes of the writer itself, other openers only need to see a new size
+    if (grown) notify(ino, NULL, -1);
+
+    free(vec);
+    free(dst);
+}
+
+/// Allocate space for an open file, or punch a hole with `FALLOC_FL_PUNCH_HOLE`
+void ramFallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    inode* node = (inode*)fi->fh;
+    writeLock(node);
+    int err = allocateNode(node, mode, offset, length) ? 0 : errno;
+    unlock(node);
+    fuse_reply_err(req, err);
+}
+
+/// Release an open file, the inode goes away here if it was unlinked while open
+void ramRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    Filesystem* fs = fuse_req_userdata(req);
+    inode* node = (inode*)fi->fh;
+    // off the critical path of the process, the kernel does not wait for release
+    if (fs->dedup) {
+        writeLock(node);
+        dedupNode(node);
+        unlock(node);
+    }
+    closeNode(node);
+    fuse_reply_err(req, 0);
+}
+
+/// Open directory, the handle is a `cursor`
+void ramOpendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    inode* node = toNode(req, ino);
+    if (!isDir(node)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    cursor* at = calloc(1, sizeof(cursor));
+    if (!at) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uint64_t)at;
+    if (fuse_reply_open(req, fi) != 0) free(at);
+}
+
+/// Read directory, offsets are entry cookies, stable while others come and go
+void ramReaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    cursor* at = (cursor*)fi->fh;
+    char* buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    enterEpoch();
+    directory* dir = asDir(toNode(req, ino)); // `NULL` if removed while open
+    size_t used = 0;
+    entry* last = NULL;
+    for (entry* p = dir ? seekEntry(dir, (uint64_t)offset, at) : NULL; p; p = p->next) {
+        struct stat statbuf = {
+            .st_ino = p->node->ino,
+            .st_mode = p->node->mode
+        };
+        size_t n = fuse_add_direntry(req, buf + used, size - used, p->name, &statbuf, (off_t)p->cookie);
+        if (n > size - used) break;
+        used += n;
+        last = p;
+    }
+    if (last) moveCursor(at, last);
+    exitEpoch();
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+/// Release directory
+void ramReleasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    free((cursor*)fi->fh);
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
+}
+
+/// Get file system statistics, usage is counted as it changes
+void ramStatfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs statv;
+    statFilesystem(fuse_req_userdata(req), &statv);
+    fuse_reply_statfs(req, &statv);
+}
+
+#ifdef PageCompression
+/// Get an extended attribute, only `PackingAttribute` of regular files is there
+void ramGetxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    inode* node = toNode(req, ino);
+    if (!isFile(node) || strcmp(name, PackingAttribute) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+
+    char value[96];
+    readLock(node);
+    ssize_t n = packingAttribute(node, value, size < sizeof(value) ? size : sizeof(value));
+    unlock(node);
+
+    if (n < 0) fuse_reply_err(req, errno);
+    else if (!size) fuse_reply_xattr(req, (size_t)n);
+    else fuse_reply_buf(req, value, (size_t)n);
+}
+#endif
+
+/// Initialize filesystem, `userdata` was created in `main`
+void ramInit(void *userdata, struct fuse_conn_info *conn) {
+    negotiate(conn, &opts);
+    fprintf(stderr, "Filesystem initialized\n");
+}
+
+/// Clean up filesystem
+void ramDestroy(void *userdata) {
+    fprintf(stderr, "Destroying the filesystem\n");
+    stopSaver();
+    releaseFilesystem(userdata);
+}
+
+struct fuse_lowlevel_ops operations = {
+    .init = ramInit,
+    .destroy = ramDestroy,
+    .lookup = ramLookup,
+    .forget = ramForget,
+    .getattr = ramGetattr,
+    .setattr = ramSetattr,
+    .mknod = ramMknod,
+    .mkdir = ramMkdir,
+    .unlink = ramUnlink,
+    .rmdir = ramRmdir,
+    .rename = ramRename,
+    .link = ramLink,
+    .open = ramOpen,
+    .read = ramRead,
+    .write_buf = ramWriteBuf,
+    .release = ramRelease,
+    .fallocate = ramFallocate,
+    .opendir = ramOpendir,
+    .readdir = ramReaddir,
+    .releasedir = ramReleasedir,
+    .statfs = ramStatfs,
+#ifdef PageCompression
+    .getxattr = ramGetxattr,
+#endif
+};
+
+int main(int argc, char *argv[]) {
+    fprintf(stderr, "Fuse library version %d.%d\n", FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char* mountpoint;
+    int multithreaded, foreground;
+    if (fuse_opt_parse(&args, &timeouts, timeoutOptions, NULL) == -1) return 1;
+    if (parseOptions(&args, &opts) == -1) return 1;
+    if (opts.image) blockSaveSignal(); // before any thread is started
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) return 1;
+
+    struct fuse_chan* ch = fuse_mount(mountpoint, &args);
+    if (!ch) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    int err = 1;
+    Filesystem* fs = openFilesystem(&opts);
+    struct fuse_session* se = fuse_lowlevel_new(&args, &operations, sizeof(operations), fs);
+    if (se) {
+        if (fuse_set_signal_handlers(se) != -1) {
+            fuse_session_add_chan(se, ch);
+            fuse_daemonize(foreground);
+            if (!startNotifier(ch)) fprintf(stderr, "Warning: kernel caches will only expire\n");
+            if (!startReclaimer()) fprintf(stderr, "Warning: removals will free memory themselves\n");
+            startPacking(fs, &opts);
+            startSaving(fs, &opts);
+
+            // multithreaded unless `-s` is given
+            fprintf(stderr, "about to call fuse_session_loop\n");
+            err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+            fprintf(stderr, "fuse_session_loop returned %d\n", err);
+            stopNotifier();
+
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        fuse_session_destroy(se); // calls ramDestroy
+    } else {
+        releaseFilesystem(fs);
+    }
+    fuse_unmount(mountpoint, ch);
+    fuse_opt_free_args(&args);
+    free(opts.image);
+    free(opts.journal);
+
+    return err ? 1 : 0;
+}
@@ -5,8 +5,40 @@
 #include <errno.h>
 #include <fuse.h>
 #include <string.h>
+#include <fcntl.h>
 
 #include "Filesystem.h"
+#include "Options.h"
+#include "Image.h"
+#include "Stats.h"
+
+/// Every change goes through this process, so the kernel may keep whatever it has seen for long
+#define CacheOptions "-oattr_timeout=3600,entry_timeout=3600,negative_timeout=3600"
+/// Hard links share the numbers of `statNode`, which stay the same for the life of an inode
+#define InoOptions "-ouse_ino"
+
+#ifdef Statistics
+/// Contents of an open stats file, formatted once so that its reads stay consistent
+typedef struct {
+    char* text;
+    size_t length;
+} snapshot;
+
+/// Names in `StatsDirectory`, in readdir order
+static const char* statsNames[] = { ".", "..", StatsFile, StatsFile ".json" };
+
+/// Tells which part of `StatsDirectory` the `path` is, which shadows anything with the same name in the tree
+/// - Returns: `0` for the directory, `1` for the text file, `2` for the JSON one, `-1` for anything else
+static int statsPath(const char* path) {
+    size_t n = strlen(StatsDirectory);
+    if (!path || strncmp(path, StatsDirectory, n) != 0) return -1; // no path for files removed while open
+    if (path[n] == '\0') return 0;
+    if (path[n] != Split) return -1;
+    for (int i = 2; i < 4; ++i)
+        if (strcmp(path + n + 1, statsNames[i]) == 0) return i - 1;
+    return -1;
+}
+#endif
 
 /** Get file attributes.
  Similar to stat().  The `st_dev` and `st_blksize` fields are
@@ -14,18 +46,27 @@
  mount option is given.
 */
 int ramGetattr(const char *path, struct stat *statbuf) {
+    measure(StatGetattr);
     Filesystem* fs = fuse_get_context()->private_data;
+#ifdef Statistics
+    int virtual = statsPath(path);
+    if (virtual >= 0) {
+        *statbuf = (struct stat){ .st_mode = virtual ? S_IFREG | 0444 : S_IFDIR | 0555, .st_nlink = virtual ? 1 : 2 };
+        return 0;
+    }
+#endif
+
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node) {
+        readLock(node);
+        statNode(node, statbuf);
+        unlock(node);
+    }
+    exitEpoch();
 
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
-
-    statbuf->st_mode = node->mode;
-    statbuf->st_uid = node->uid;
-    statbuf->st_gid = node->gid;
-    statbuf->st_nlink = node->nlink;
-    statbuf->st_size = node->size;
-
-    return 0;
+    return result;
 }
 
 /** Create a file node
@@ -34,80 +75,70 @@ int ramGetattr(const char *path, struct stat *statbuf) {
 */
 // shouldn't that comment be "if" there is no.... ?
 int ramMknod(const char *path, mode_t mode, dev_t dev) {
+    measure(StatMknod);
     struct fuse_context* ctx = fuse_get_context();
     Filesystem* fs = ctx->private_data;
 
-    inode* node = calloc(1, sizeof(inode));
-    if (!node) return -ENOSPC;
-    node->mode = mode | S_IFREG;
-    node->uid = ctx->uid;
-    node->gid = ctx->gid;
-
-    node = addNode(path, fs->root, node);
+    inode* node = newNode(fs, mode | S_IFREG, ctx->uid, ctx->gid);
     if (!node) return -errno;
 
-    return 0;
+    writeLock(fs);
+    int result = addNode(path, fs, node) ? 0 : -errno;
+    unlock(fs);
+    if (result) dropNode(node);
+
+    return result;
 }
 
 /// Create a directory
 int ramMkdir(const char *path, mode_t mode) {
+    measure(StatMkdir);
     struct fuse_context* ctx = fuse_get_context();
     Filesystem* fs = ctx->private_data;
 
-    inode* node = calloc(1, sizeof(inode));
-    if (!node) return -ENOSPC;
-    node->mode = mode | S_IFDIR;
-    node->uid = ctx->uid;
-    node->gid = ctx->gid;
-
-    node = addNode(path, fs->root, node);
+    inode* node = newNode(fs, mode | S_IFDIR, ctx->uid, ctx->gid);
     if (!node) return -errno;
 
-    entry* ddot = malloc(sizeof(entry));
-    strcpy(ddot->name, "..");
-    ddot->node = node->parent;
-    node->parent->nlink++;
-    ddot->next = NULL;
-
-    entry* dot = malloc(sizeof(entry));
-    strcpy(dot->name, ".");
-    dot->node = node;
-    node->nlink++;
-    dot->next = ddot;
-
-    node->data = dot;
+    writeLock(fs);
+    int result = addNode(path, fs, node) ? 0 : -errno;
+    unlock(fs);
+    if (result) dropNode(node);
 
-    return 0;
+    return result;
 }
 
 /// Create a hard link to a file
 int ramLink(const char *path, const char *newpath) {
+    measure(StatLink);
     Filesystem* fs = fuse_get_context()->private_data;
 
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
-
-    if (isDir(node)) return -EPERM;
-
-    node = addNode(newpath, fs->root, node);
-    if (!node) return -errno;
+    writeLock(fs);
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node && isDir(node)) result = -EPERM;
+    else if (node && !addNode(newpath, fs, node)) result = -errno;
+    exitEpoch();
+    unlock(fs);
 
-    return 0;
+    return result;
 }
 
 /// Remove a file
 int ramUnlink(const char *path) {
+    measure(StatUnlink);
     Filesystem* fs = fuse_get_context()->private_data;
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
 
-    if (isDir(node)) return -EINVAL;
-    if (node->nopen) return -EBUSY;
+    writeLock(fs);
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node && isDir(node)) result = -EINVAL;
+    else if (node && !releaseNode(path, fs)) result = -errno;
+    exitEpoch();
+    unlock(fs);
 
-    bool ok = releaseNode(path, fs->root);
-    if (!ok) return -errno;
-
-    return 0;
+    return result;
 }
 
 /** Open directory
@@ -115,29 +146,44 @@ int ramUnlink(const char *path) {
  this  directory
 */
 int ramOpendir(const char *path, struct fuse_file_info *fi) {
+    measure(StatOpendir);
     Filesystem* fs = fuse_get_context()->private_data;
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
-    if (!isDir(node)) return -ENOTDIR;
-    fi->fh = (uint64_t)node;
+
+#ifdef Statistics
+    int virtual = statsPath(path);
+    if (virtual >= 0) return virtual ? -ENOTDIR : 0; // readdir needs no cursor there
+#endif
+
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node && !isDir(node)) result = -ENOTDIR;
+    exitEpoch();
+    if (result) return result;
+
+    cursor* at = calloc(1, sizeof(cursor));
+    if (!at) return -ENOMEM;
+    fi->fh = (uint64_t)at;
     return 0;
 }
 
 
 /** Remove a directory */
 int ramRmdir(const char *path) {
+    measure(StatRmdir);
     if (strcmp(path, "/") == 0) return -EBUSY; // mount point
     Filesystem* fs = fuse_get_context()->private_data;
 
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
-
-    if (!isDir(node)) return -ENOTDIR;
-
-    bool ok = releaseNode(path, fs->root);
-    if (!ok) return -errno;
+    writeLock(fs);
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node && !isDir(node)) result = -ENOTDIR;
+    else if (node && !releaseNode(path, fs)) result = -errno;
+    exitEpoch();
+    unlock(fs);
 
-    return 0;
+    return result;
 }
 
 /** Read directory
@@ -145,63 +191,63 @@ int ramRmdir(const char *path) {
  This supersedes the old getdir() interface.  New applications
  should use this.
 
- The readdir implementation ignores the offset parameter, and
- passes zero to the filler function's offset.  The filler
- function will not return '1' (unless an error happens), so the
- whole directory is read in a single readdir operation.  This
- works just like the old getdir() method.
+ Entries are passed with their cookies as offsets, so the filler
+ returns '1' once the buffer is full and the next call continues
+ from the `offset` of the last entry that fit. The `cursor` of the
+ handle makes that resume in constant time.
  */
 int ramReaddir(const char *path, void *buf, fuse_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi) {
+    measure(StatReaddir);
     Filesystem* fs = fuse_get_context()->private_data;
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
-
-    if (!isDir(node)) return -ENOTDIR;
-
-    for (entry* p = node->data; p; p = p->next)
-        filler(buf, p->name, NULL, 0);
+#ifdef Statistics
+    if (statsPath(path) == 0) {
+        for (off_t i = offset; i < 4; ++i)
+            if (filler(buf, statsNames[i], NULL, i + 1)) break;
+        return 0;
+    }
+#endif
+
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    directory* dir = node && isDir(node) ? asDir(node) : NULL;
+    if (node && !isDir(node)) result = -ENOTDIR;
+    else if (node && !dir) result = -ENOENT; // removed meanwhile
+    else if (node) {
+        cursor* at = (cursor*)fi->fh;
+        entry* last = NULL;
+        for (entry* p = seekEntry(dir, (uint64_t)offset, at); p; p = p->next) {
+            struct stat statbuf = { .st_ino = p->node->ino, .st_mode = p->node->mode }; // the rest is not used
+            if (filler(buf, p->name, &statbuf, (off_t)p->cookie)) break;
+            last = p;
+        }
+        if (last) moveCursor(at, last);
+    }
+    exitEpoch();
 
-    return 0;
+    return result;
 }
 
-/// Release directory (does absolutely nothing)
+/// Release directory
 int ramReleasedir(const char *path, struct fuse_file_info *fi) {
+    measure(StatReleasedir);
+    free((cursor*)fi->fh);
     fi->fh = 0;
     return 0;
 }
 
-bool isValidRename(const char* path, const char* newpath) {
-    size_t n = strlen(path);
-    if (strncmp(path, newpath, n) == 0 && strlen(newpath) > n) {
-        // path is a prefix of newpath
-        if (newpath[n] == Split) return false;
-    }
-    // . or .. are not allowed in this
-    if (strchr(newpath, '.') || strchr(path, '.'))
-        return false;
-    return true;
-}
-
 /// Rename a file
 // both path and newpath are fs-relative
 int ramRename(const char *path, const char *newpath) {
+    measure(StatRename);
     Filesystem* fs = fuse_get_context()->private_data;
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
 
-    if (!isValidRename(path, newpath)) return -EINVAL;
-
-    if ((node = pathfind(newpath, fs->root))) {
-        if (isDir(node)) return -EISDIR; // will not recursively delete whole direcoty
-        bool ok = releaseNode(newpath, fs->root);
-        if (!ok) return -errno;
-    }
+    writeLock(fs);
+    int result = moveNode(path, newpath, fs) ? 0 : -errno;
+    unlock(fs);
 
-    node = moveNode(path, newpath, fs->root);
-    if (!node) return -errno;
-
-    return 0;
+    return result;
 }
 
 /** File open operation
@@ -213,15 +259,39 @@ int ramRename(const char *path, const char *newpath) {
  which will be passed to all file operations.
 */
 int ramOpen(const char *path, struct fuse_file_info *fi) {
+    measure(StatOpen);
     Filesystem* fs = fuse_get_context()->private_data;
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
-    if (isDir(node)) return -EISDIR;
-
-    node->nopen++;
-    fi->fh = (uint64_t)node;
+#ifdef Statistics
+    int virtual = statsPath(path);
+    if (virtual == 0) return -EISDIR;
+    if (virtual > 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+        snapshot* s = malloc(sizeof(snapshot));
+        if (s) s->text = formatStats(&fs->quota, virtual == 2, &s->length);
+        if (!s || !s->text) {
+            free(s);
+            return -ENOMEM;
+        }
+        fi->fh = (uint64_t)s;
+        fi->direct_io = 1; // the size is not known up front
+        return 0;
+    }
+#endif
+
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node && isDir(node)) result = -EISDIR;
+    else if (node && !openNode(node)) result = -errno;
+    else if (node) {
+        fi->fh = (uint64_t)node;
+        writeLock(node);
+        fi->keep_cache = keepCache(node);
+        unlock(node);
+    }
+    exitEpoch();
 
-    return 0;
+    return result;
 }
 
 /** Read data from an open file
@@ -241,15 +311,24 @@ int ramOpen(const char *path, struct fuse_file_info *fi) {
 // with the fusexmp code which returns the amount of data also
 // returned by read.
 int ramRead(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    measure(StatRead);
+#ifdef Statistics
+    if (statsPath(path) > 0) {
+        snapshot* s = (snapshot*)fi->fh;
+        if (offset < 0 || (size_t)offset >= s->length) return 0;
+        size_t n = s->length - (size_t)offset < size ? s->length - (size_t)offset : size;
+        memcpy(buf, s->text + offset, n);
+        return (int)n;
+    }
+#endif
     inode* node = (inode*)fi->fh;
-    if (!node->nopen) return -EBADF;
-
     if (isDir(node)) return -EISDIR;
-    if (offset + size > node->size) size = node->size; //hreturn -EINVAL;
 
-    memcpy(buf, (char*)node->data + offset, size);
+    if (!lockRange(node, size, offset)) return -errno;
+    int result = (int)readNode(node, buf, size, offset);
+    unlock(node);
 
-    return (int)size;
+    return result;
 }
 
 /** Write data to an open file
@@ -260,42 +339,76 @@ int ramRead(const char *path, char *buf, size_t size, off_t offset, struct fuse_
  */
 // As  with read(), the documentation above is inconsistent with the
 // documentation for the write() system call.
-int ramWrite(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+// The data is copied from the request or the splice pipe straight into the pages.
+int ramWriteBuf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    measure(StatWrite);
     inode* node = (inode*)fi->fh;
-    if (!node->nopen) return -EBADF;
-
     if (isDir(node)) return -EISDIR;
+    size_t size = fuse_buf_size(buf);
+
+    size_t capacity = storageMapCapacity(size);
+    struct iovec* vec = malloc(capacity * sizeof(struct iovec));
+    struct fuse_bufvec* dst = malloc(sizeof(struct fuse_bufvec) + capacity * sizeof(struct fuse_buf));
+    if (!vec || !dst) {
+        free(vec);
+        free(dst);
+        return -ENOMEM;
+    }
 
-    if (offset + size > node->size) {
-        char* data = realloc(node->data, offset + size);
-        if (!data) return -ENOSPC;
-        node->data = data;
-        node->size = (uint)(size + offset);
+    writeLock(node);
+    ssize_t count = reserveNode(node, vec, size, offset);
+    ssize_t written = count < 0 ? -errno : 0;
+    if (count > 0) {
+        *dst = (struct fuse_bufvec){ .count = (size_t)count };
+        for (ssize_t i = 0; i < count; ++i)
+            dst->buf[i] = (struct fuse_buf){ .size = vec[i].iov_len, .mem = vec[i].iov_base, .fd = -1 };
+        written = fuse_buf_copy(dst, buf, 0);
     }
-    memcpy((char*)node->data + offset, buf, size);
+    if (count >= 0) commitNode(node, size, written < 0 ? 0 : (size_t)written, offset);
+    unlock(node);
 
-    return (int)size;
+    free(vec);
+    free(dst);
+    return (int)written;
 }
 
 int ramTruncate(const char* path, off_t offset) {
+    measure(StatTruncate);
     Filesystem* fs = fuse_get_context()->private_data;
-    inode* node = pathfind(path, fs->root);
-    if (!node) return -errno;
-    if (isDir(node)) return -EISDIR;
 
-    if (offset == 0) {
-        if (node->data) free(node->data);
-        node->data = NULL;
-    } else {
-        char* data = realloc(node->data, offset);
-        if (!data) return -ENOSPC;
-        node->data = data;
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node && isDir(node)) result = -EISDIR;
+    else if (node) {
+        writeLock(node);
+        if (!truncateNode(node, offset)) result = -errno;
+        unlock(node);
     }
-    if (offset > node->size)
-        memset(node->data + node->size, 0, offset - node->size);
-    node->size = (uint)offset;
+    exitEpoch();
 
-    return 0;
+    return result;
+}
+
+/**
+ * Allocates space for an open file
+ *
+ * This function ensures that required space is allocated for specified
+ * file.  If this function returns success then any subsequent write
+ * request to specified range is guaranteed not to fail because of lack
+ * of space on the file system media.
+ */
+// `FALLOC_FL_PUNCH_HOLE` frees the pages instead, other modes are not supported.
+int ramFallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    measure(StatFallocate);
+    inode* node = (inode*)fi->fh;
+    if (isDir(node)) return -EISDIR;
+
+    writeLock(node);
+    int result = allocateNode(node, mode, offset, length) ? 0 : -errno;
+    unlock(node);
+
+    return result;
 }
 
 /** Release an open file
@@ -311,16 +424,59 @@ int ramTruncate(const char* path, off_t offset) {
  file.  The return value of release is ignored.
 */
 int ramRelease(const char *path, struct fuse_file_info *fi) {
+    measure(StatRelease);
+    Filesystem* fs = fuse_get_context()->private_data;
+#ifdef Statistics
+    if (statsPath(path) > 0) {
+        free(((snapshot*)fi->fh)->text);
+        free((snapshot*)fi->fh);
+        return 0;
+    }
+#endif
     inode* node = (inode*)fi->fh;
-    if (!node->nopen) return -EBADF;
-    if (--node->nopen == 0 && node->nlink == 0) {
-        Filesystem* fs = fuse_get_context()->private_data;
-        bool ok = releaseNode(path, fs->root);
-        if (!ok) return -errno;
+    // off the critical path of the process, the kernel does not wait for release
+    if (fs->dedup) {
+        writeLock(node);
+        dedupNode(node);
+        unlock(node);
     }
+    closeNode(node);
     return 0;
 }
 
+/** Get file system statistics
+ The 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
+*/
+// Usage is counted as it changes, so this is cheap enough for `df` to poll.
+int ramStatfs(const char *path, struct statvfs *statv) {
+    measure(StatStatfs);
+    statFilesystem(fuse_get_context()->private_data, statv);
+    return 0;
+}
+
+#ifdef PageCompression
+/** Get extended attributes */
+// Only `PackingAttribute` of regular files is there.
+int ramGetxattr(const char *path, const char *name, char *value, size_t size) {
+    measure(StatGetxattr);
+    Filesystem* fs = fuse_get_context()->private_data;
+
+    enterEpoch();
+    inode* node = lookupNode(path, fs);
+    int result = node ? 0 : -errno;
+    if (node && (!isFile(node) || strcmp(name, PackingAttribute) != 0)) result = -ENODATA;
+    else if (node) {
+        readLock(node);
+        ssize_t n = packingAttribute(node, value, size);
+        unlock(node);
+        result = n < 0 ? -errno : (int)n;
+    }
+    exitEpoch();
+
+    return result;
+}
+#endif
+
 /**
  Initialize filesystem
 
@@ -336,7 +492,13 @@ int ramRelease(const char *path, struct fuse_file_info *fi) {
 // (and this might as well return void, as it did in older versions of
 // FUSE).
 void *ramInit(struct fuse_conn_info *conn) {
-    Filesystem* fs = newFilesystem();
+    options* opts = fuse_get_context()->private_data; // from `main`
+    negotiate(conn, opts);
+
+    Filesystem* fs = openFilesystem(opts);
+    if (!startReclaimer()) fprintf(stderr, "Warning: removals will free memory themselves\n");
+    startPacking(fs, opts);
+    startSaving(fs, opts);
     fprintf(stderr, "Filesystem initialized\n");
     return fs;
 }
@@ -349,8 +511,8 @@ void *ramInit(struct fuse_conn_info *conn) {
 void ramDestroy(void *userdata) {
     Filesystem* fs = fuse_get_context()->private_data;
     fprintf(stderr, "Destroying the filesystem\n");
-    releaseAll(fs->root);
-    free(fs);
+    stopSaver();
+    releaseFilesystem(fs);
 }
 
 struct fuse_operations operations = {
@@ -364,12 +526,17 @@ struct fuse_operations operations = {
     .link = ramLink,
     .open = ramOpen,
     .read = ramRead,
-    .write = ramWrite,
+    .write_buf = ramWriteBuf,
     .release = ramRelease,
     .truncate = ramTruncate,
+    .fallocate = ramFallocate,
     .opendir = ramOpendir,
     .readdir = ramReaddir,
     .releasedir = ramReleasedir,
+    .statfs = ramStatfs,
+#ifdef PageCompression
+    .getxattr = ramGetxattr,
+#endif
     .init = ramInit,
     .destroy = ramDestroy
 };
@@ -378,10 +545,20 @@ int main(int argc, char *argv[]) {
     // See which version of fuse we're running
     fprintf(stderr, "Fuse library version %d.%d\n", FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION);
 
+    // defaults go first, so that the options given win
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_insert_arg(&args, 1, CacheOptions) == -1 || fuse_opt_insert_arg(&args, 1, InoOptions) == -1) return 1;
+    options opts = {0};
+    if (parseOptions(&args, &opts) == -1) return 1;
+    if (opts.image) blockSaveSignal(); // before libfuse starts any thread
+
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main\n");
-    int ok = fuse_main(argc, argv, &operations, NULL);
+    int ok = fuse_main(args.argc, args.argv, &operations, &opts);
     fprintf(stderr, "fuse_main returned %d\n", ok);
+    fuse_opt_free_args(&args);
+    free(opts.image);
+    free(opts.journal);
 
     return ok;
 }
@@ -0,0 +1,323 @@
+/// Workloads through a mounted filesystem, so that they include the round trips to the kernel:
+/// - extract: a source tree written file by file, the way tar unpacks one
+/// - build: stat, open, read and close of the files of that tree from every thread, like a parallel compile
+/// - seqwrite, seqread, randwrite, randread: requests to one file from a thread per request in flight,
+///   like fio with psync and as many jobs as the queue depth
+/// - churn: creations and removals of files in a directory per thread
+/// Prints one JSON object per line with ops per second and latency percentiles,
+/// usage: `./workload MOUNTPOINT [seconds per run] [max threads] [label]`
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define NDirs 64
+#define NFiles 64
+#define MaxFileSize (64 << 10)
+#define IoFileSize ((off_t)256 << 20)
+#define SeqSize (1 << 20)
+#define RandSize (4 << 10)
+#define BufSize (MaxFileSize > SeqSize ? MaxFileSize : SeqSize)
+
+/// Latencies in nanoseconds, `SubBits` bits after the leading one each: about 3% of error across the whole range
+#define SubBits 5
+#define NBuckets (64 << SubBits)
+
+typedef struct {
+    uint64_t counts[NBuckets];
+    uint64_t ops;
+    uint64_t errors;
+} histogram;
+
+typedef struct worker {
+    int id;
+    unsigned seed;
+    uint64_t count;
+    char* buf;
+    histogram h;
+} worker;
+
+typedef bool (*operation)(worker* w);
+
+static const char* mount;
+static const char* label;
+static atomic_bool running;
+static int ioFile;
+static size_t ioSize;
+static _Atomic off_t cursor;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/// Below `1 << SubBits` a bucket each, above that the bits after the leading one split every power of two
+static void record(histogram* h, uint64_t ns) {
+    int bucket = (int)ns;
+    if (ns >= (1u << SubBits)) {
+        int shift = 64 - __builtin_clzll(ns) - SubBits - 1;
+        bucket = ((shift + 1) << SubBits) | (int)((ns >> shift) & ((1u << SubBits) - 1));
+    }
+    h->counts[bucket]++;
+    h->ops++;
+}
+
+static void merge(histogram* into, const histogram* h) {
+    for (int i = 0; i < NBuckets; ++i) into->counts[i] += h->counts[i];
+    into->ops += h->ops;
+    into->errors += h->errors;
+}
+
+/// The middle of the bucket the `fraction` of the latencies falls in, in microseconds
+static double percentile(const histogram* h, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * h->ops), seen = 0;
+    for (int i = 0; i < NBuckets; ++i) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            uint64_t sub = (uint64_t)(i & ((1 << SubBits) - 1));
+            if (i < (1 << SubBits)) return sub / 1000.0;
+            int shift = (i >> SubBits) - 1;
+            uint64_t low = ((1ull << SubBits) + sub) << shift;
+            return (low + ((1ull << shift) - 1) / 2.0) / 1000;
+        }
+    }
+    return 0;
+}
+
+static void print(const char* name, int threads, size_t bytes, double seconds, const histogram* h) {
+    printf("{\"workload\":\"%s\",\"label\":\"%s\",\"threads\":%d,", name, label, threads);
+    if (bytes) printf("\"io_size\":%zu,\"mb_per_sec\":%.1f,", bytes, h->ops * bytes / seconds / (1 << 20));
+    printf("\"seconds\":%.3f,\"ops\":%llu,\"errors\":%llu,\"ops_per_sec\":%.0f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+           seconds, (unsigned long long)h->ops, (unsigned long long)h->errors, h->ops / seconds,
+           percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999));
+    fflush(stdout);
+}
+
+static void sourcePath(char* path, size_t size, int dir, int file) {
+    if (file < 0) snprintf(path, size, "%s/src/d%d", mount, dir);
+    else snprintf(path, size, "%s/src/d%d/f%d.c", mount, dir, file);
+}
+
+/// Sizes like those of sources, most small and a few up to `MaxFileSize`
+static size_t sourceSize(int dir, int file) {
+    unsigned seed = (unsigned)(dir * NFiles + file);
+    size_t size = 256 + rand_r(&seed) % 4096;
+    return rand_r(&seed) % 8 ? size : size + rand_r(&seed) % (MaxFileSize - size);
+}
+
+static bool build(worker* w) {
+    int dir = rand_r(&w->seed) % NDirs, file = rand_r(&w->seed) % NFiles;
+    char path[512];
+    sourcePath(path, sizeof(path), dir, file);
+
+    struct stat st;
+    if (stat(path, &st) == -1) return false;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+    ssize_t n;
+    while ((n = read(fd, w->buf, MaxFileSize)) > 0) {}
+    close(fd);
+    return n == 0;
+}
+
+static bool churn(worker* w) {
+    char path[512];
+    uint64_t i = w->count++;
+    snprintf(path, sizeof(path), "%s/churn/t%d/f%llu", mount, w->id, (unsigned long long)(i % 1024));
+    // batches of 1024 creations and as many removals, so that the directory has something in it
+    if ((i / 1024) % 2) return unlink(path) == 0;
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd == -1) return false;
+    close(fd);
+    return true;
+}
+
+static off_t nextOffset(void) {
+    return atomic_fetch_add(&cursor, (off_t)ioSize) % IoFileSize;
+}
+
+static off_t randomOffset(worker* w) {
+    off_t blocks = IoFileSize / (off_t)ioSize;
+    return ((off_t)rand_r(&w->seed) * RAND_MAX + rand_r(&w->seed)) % blocks * (off_t)ioSize;
+}
+
+static bool seqWrite(worker* w) {
+    return pwrite(ioFile, w->buf, ioSize, nextOffset()) == (ssize_t)ioSize;
+}
+
+static bool seqRead(worker* w) {
+    return pread(ioFile, w->buf, ioSize, nextOffset()) == (ssize_t)ioSize;
+}
+
+static bool randWrite(worker* w) {
+    return pwrite(ioFile, w->buf, ioSize, randomOffset(w)) == (ssize_t)ioSize;
+}
+
+static bool randRead(worker* w) {
+    return pread(ioFile, w->buf, ioSize, randomOffset(w)) == (ssize_t)ioSize;
+}
+
+typedef struct {
+    worker* w;
+    operation op;
+} job;
+
+static void* loop(void* arg) {
+    job* j = arg;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        uint64_t start = now();
+        if (!j->op(j->w)) j->w->h.errors++;
+        record(&j->w->h, now() - start);
+    }
+    return NULL;
+}
+
+/// `op` from `threads` threads for `seconds`
+static void run(const char* name, operation op, int threads, size_t bytes, double seconds) {
+    pthread_t ids[threads];
+    job jobs[threads];
+    worker* workers = calloc((size_t)threads, sizeof(worker));
+
+    atomic_store(&running, true);
+    uint64_t start = now();
+    for (int i = 0; i < threads; ++i) {
+        workers[i] = (worker){ .id = i, .seed = (unsigned)i + 1, .buf = malloc(BufSize) };
+        memset(workers[i].buf, 'x', BufSize);
+        jobs[i] = (job){ &workers[i], op };
+        pthread_create(&ids[i], NULL, loop, &jobs[i]);
+    }
+
+    struct timespec duration = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    nanosleep(&duration, NULL);
+    atomic_store(&running, false);
+
+    histogram* total = calloc(1, sizeof(histogram));
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(ids[i], NULL);
+        merge(total, &workers[i].h);
+        free(workers[i].buf);
+    }
+    print(name, threads, bytes, (now() - start) * 1e-9, total);
+    free(total);
+    free(workers);
+}
+
+/// The tree `build` reads, once through and timed by the file
+static bool extract(void) {
+    char path[512], *buf = malloc(MaxFileSize);
+    memset(buf, 'x', MaxFileSize);
+    histogram* h = calloc(1, sizeof(histogram));
+
+    snprintf(path, sizeof(path), "%s/src", mount);
+    bool ok = mkdir(path, 0755) == 0;
+    uint64_t start = now();
+    for (int d = 0; ok && d < NDirs; ++d) {
+        sourcePath(path, sizeof(path), d, -1);
+        uint64_t begin = now();
+        ok = mkdir(path, 0755) == 0;
+        record(h, now() - begin);
+        for (int f = 0; ok && f < NFiles; ++f) {
+            sourcePath(path, sizeof(path), d, f);
+            size_t size = sourceSize(d, f);
+            begin = now();
+            int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+            ok = fd != -1 && write(fd, buf, size) == (ssize_t)size;
+            if (fd != -1) ok = close(fd) == 0 && ok;
+            record(h, now() - begin);
+        }
+    }
+    if (ok) print("extract", 1, 0, (now() - start) * 1e-9, h);
+    else fprintf(stderr, "extract: %s: %s\n", path, strerror(errno));
+
+    free(h);
+    free(buf);
+    return ok;
+}
+
+static int removeEntry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st, (void)type, (void)ftw;
+    return remove(path);
+}
+
+static void removeTree(const char* name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", mount, name);
+    nftw(path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/// A directory for each thread of `churn`, empty
+static void makeChurn(int threads) {
+    char path[512];
+    removeTree("churn");
+    snprintf(path, sizeof(path), "%s/churn", mount);
+    mkdir(path, 0755);
+    for (int i = 0; i < threads; ++i) {
+        snprintf(path, sizeof(path), "%s/churn/t%d", mount, i);
+        mkdir(path, 0755);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    mount = argc > 1 ? argv[1] : NULL;
+    double seconds = argc > 2 ? atof(argv[2]) : 5.0;
+    int maxThreads = argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    label = argc > 4 ? argv[4] : "";
+    struct stat st;
+    if (!mount || stat(mount, &st) == -1 || !S_ISDIR(st.st_mode) || seconds <= 0 || maxThreads < 1) {
+        fprintf(stderr, "usage: %s MOUNTPOINT [seconds per run] [max threads] [label]\n", argv[0]);
+        return 1;
+    }
+
+    if (!extract()) return 1;
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+        run("build", build, threads, 0, seconds);
+    removeTree("src");
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        makeChurn(threads);
+        run("churn", churn, threads, 0, seconds);
+    }
+    removeTree("churn");
+
+    // the whole file is there before anything reads it
+    char path[512];
+    snprintf(path, sizeof(path), "%s/io", mount);
+    ioFile = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (ioFile == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    char* buf = malloc(SeqSize);
+    memset(buf, 'x', SeqSize);
+    for (off_t offset = 0; offset < IoFileSize; offset += SeqSize)
+        if (pwrite(ioFile, buf, SeqSize, offset) != SeqSize) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+    free(buf);
+
+    static const int depths[] = { 1, 4, 16 };
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+        ioSize = SeqSize;
+        run("seqwrite", seqWrite, depths[d], ioSize, seconds);
+        run("seqread", seqRead, depths[d], ioSize, seconds);
+        ioSize = RandSize;
+        run("randwrite", randWrite, depths[d], ioSize, seconds);
+        run("randread", randRead, depths[d], ioSize, seconds);
+    }
+    close(ioFile);
+    unlink(path);
+    return 0;
+}